@@ -1364,6 +1364,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--direct-io"},
+        "read the model with O_DIRECT when mmap is disabled, bypassing the page cache (Linux only)",
+        [](common_params & params) {
+            params.use_direct_io = true;
+        }
+    ).set_env("LLAMA_ARG_DIRECT_IO"));
+    add_opt(common_arg(
+        {"--prefetch-layers"}, "N",
+        "stream memory mapped weights for models larger than RAM: prefetch N layers ahead of the one being\n"
+        "evaluated and release the layers already evaluated (default: 0 = disabled)",
+        [](common_params & params, int value) {
+            params.n_prefetch_layers = value;
+        }
+    ).set_env("LLAMA_ARG_PREFETCH_LAYERS"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -1809,6 +1824,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens to process in a batch while other slots are generating (default: %d, 0 = batch size)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--max-queue"}, "N",
+        string_format("max number of requests waiting for a slot, the lowest priority ones are rejected beyond this with error 429 (default: %d, 0 = no limit)", params.n_max_queue),
+        [](common_params & params, int value) {
+            params.n_max_queue = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_QUEUE"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -1848,6 +1877,24 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--kv-offload-ram"}, "N",
+        string_format("host memory in MiB for keeping the KV cache of idle slots for later requests (default: %d, 0 = disabled)", params.kv_offload_ram),
+        [](common_params & params, int value) {
+            params.kv_offload_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_OFFLOAD_RAM"));
+    add_opt(common_arg(
+        {"--kv-offload-path"}, "PATH",
+        "path to write the KV cache of idle slots that does not fit in --kv-offload-ram (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_offload_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_offload_path.empty() && params.kv_offload_path[params.kv_offload_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_offload_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_OFFLOAD_PATH"));
     add_opt(common_arg(
         {"--chat-template"}, "JINJA_TEMPLATE",
         "set custom jinja chat template (default: template taken from model's metadata)\n"
@@ -998,6 +998,8 @@ struct llama_model_params common_model_params_to_llama(const common_params & par
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.use_direct_io   = params.use_direct_io;
+    mparams.n_prefetch_layers = params.n_prefetch_layers;
     mparams.check_tensors   = params.check_tensors;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1525,6 +1527,41 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+          const struct llama_model * model,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                               int   n_threads) {
+    std::vector<const char *> ptrs(texts.size());
+    std::vector<int32_t>      lens(texts.size());
+    std::vector<int32_t>      n_tokens(texts.size());
+
+    // upper limit for the number of tokens
+    int n_max = 0;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ptrs[i] = texts[i].data();
+        lens[i] = texts[i].length();
+        n_max += texts[i].length() + 2 * add_special;
+    }
+
+    std::vector<llama_token> tokens(n_max);
+    int n_total = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), n_tokens.data(), add_special, parse_special, n_threads);
+    if (n_total < 0) {
+        tokens.resize(-n_total);
+        int check = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), n_tokens.data(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_total);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+    size_t offset = 0;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result[i].assign(tokens.begin() + offset, tokens.begin() + offset + n_tokens[i]);
+        offset += n_tokens[i];
+    }
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     std::string piece;
     piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
@@ -2019,6 +2056,7 @@ void yaml_dump_non_result_info(FILE * stream, const common_params & params, cons
     fprintf(stream, "chunks: %d # default: -1 (unlimited)\n", params.n_chunks);
     fprintf(stream, "color: %s # default: false\n", params.use_color ? "true" : "false");
     fprintf(stream, "ctx_size: %d # default: 512\n", params.n_ctx);
+    fprintf(stream, "direct_io: %s # default: false\n", params.use_direct_io ? "true" : "false");
     fprintf(stream, "escape: %s # default: false\n", params.escape ? "true" : "false");
     fprintf(stream, "file: # never logged, see prompt instead. Can still be specified for input.\n");
     fprintf(stream, "frequency_penalty: %f # default: 0.0 \n", sparams.penalty_freq);
@@ -161,6 +161,7 @@ struct common_params {
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     int32_t main_gpu              =     0; // the GPU that is used for scratch and small tensors
+    int32_t n_prefetch_layers     =     0; // layers to prefetch ahead when streaming mmap'd weights (0 = disabled)
     float   tensor_split[128]     =   {0}; // how split tensors should be distributed across GPUs
     int32_t grp_attn_n            =     1; // group-attention factor
     int32_t grp_attn_w            =   512; // group-attention width
@@ -258,6 +259,7 @@ struct common_params {
     bool logits_all        = false; // return logits for all tokens in the batch
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool use_direct_io     = false; // use O_DIRECT reads when not using mmap
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
@@ -280,11 +282,14 @@ struct common_params {
     bool reranking         = false; // enable reranking support on server
 
     // server params
-    int32_t port           = 8080;         // server listens on this network port
-    int32_t timeout_read   = 600;          // http read timeout in seconds
-    int32_t timeout_write  = timeout_read; // http write timeout in seconds
-    int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
-    int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t port             = 8080;         // server listens on this network port
+    int32_t timeout_read     = 600;          // http read timeout in seconds
+    int32_t timeout_write    = timeout_read; // http write timeout in seconds
+    int32_t n_threads_http   = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t n_cache_reuse    = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t kv_offload_ram   = 0;            // host memory budget in MiB for the KV cache of idle slots
+    int32_t n_prefill_budget = 0;            // max prompt tokens per batch while other slots are generating (0 = n_batch)
+    int32_t n_max_queue      = 0;            // max requests waiting for a slot, beyond which they are rejected (0 = no limit)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -305,6 +310,7 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string kv_offload_path; // directory for the KV cache of idle slots that exceeds kv_offload_ram
 
     float slot_prompt_similarity = 0.5f;
 
@@ -470,6 +476,14 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes multiple strings using up to n_threads threads
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+          const struct llama_model * model,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                               int   n_threads);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string common_token_to_piece(
@@ -2,7 +2,12 @@
 
 #include "common.h"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
@@ -110,19 +115,96 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    std::vector<uint32_t> mask;
+    std::vector<float>    masked; // the logits with the mask applied
 
+    // truncation at the start of the chain, used to build only the candidates that can survive it (0 = none)
+    int32_t first_top_k;
+    float   first_min_p;
+
+    // tokens whose logits the chain can change before the truncation
+    std::vector<llama_token> keep;
+
+    // note: logits is a row of llama_get_logits_ith(ctx, ...), which is not called here so that the samplers of
+    //       different sequences can set their logits in parallel
+    void set_logits(struct llama_context * ctx, const float * logits) {
         const int n_vocab = llama_n_vocab(llama_get_model(ctx));
 
         cur.resize(n_vocab);
 
+        if (first_top_k > 0 || first_min_p > 0.0f) {
+            keep.clear();
+
+            for (const auto & lb : params.logit_bias) {
+                keep.push_back(lb.token);
+            }
+
+            if (params.ignore_eos) {
+                keep.push_back(llama_token_eos(llama_get_model(ctx)));
+            }
+
+            const bool penalties = params.penalty_last_n > 0 &&
+                (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f);
+
+            if (penalties) {
+                // prev holds at least the last penalty_last_n tokens
+                for (int i = 0; i < std::min<int>(params.penalty_last_n, prev.size()); ++i) {
+                    keep.push_back(prev.rat(i));
+                }
+            }
+
+            const size_t n = llama_logits_get_candidates(logits, n_vocab, first_top_k, first_min_p, params.min_keep, keep.data(), keep.size(), cur.data());
+
+            cur_p = { cur.data(), n, -1, false };
+
+            return;
+        }
+
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
             cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
         }
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // same as set_logits followed by applying the grammar, except that the grammar is applied to the logits before
+    // the candidates are built
+    void set_logits_grammar(struct llama_context * ctx, const float * logits) {
+        const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+        mask.resize(LLAMA_TOKEN_MASK_SIZE(n_vocab));
+        if (!llama_sampler_get_mask(grmr, mask.data(), n_vocab)) {
+            set_logits(ctx, logits);
+            llama_sampler_apply(grmr, &cur_p);
+            return;
+        }
+
+        if (first_top_k > 0 || first_min_p > 0.0f) {
+            // mask the logits, so that the truncation at the start of the chain only keeps allowed tokens
+            masked.assign(logits, logits + n_vocab);
+            llama_token_mask_apply(masked.data(), mask.data(), n_vocab);
+            set_logits(ctx, masked.data());
+            return;
+        }
+
+        cur.clear();
+
+        for (int iw = 0; iw < (int) mask.size(); ++iw) {
+            const uint32_t word = mask[iw];
+            if (word == 0) {
+                continue;
+            }
+
+            for (int j = 0; j < 32; ++j) {
+                if ((word >> j) & 1) {
+                    const llama_token token_id = 32*iw + j;
+                    cur.push_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                }
+            }
+        }
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+    }
 };
 
 std::string common_sampler_params::print() const {
@@ -145,14 +227,29 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
     lparams.no_perf = params.no_perf;
 
     auto * result = new common_sampler {
-        /* .params = */ params,
-        /* .grmr   = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
-        /* .chain  = */ llama_sampler_chain_init(lparams),
-        /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
-        /* .cur    = */ {},
-        /* .cur_p  = */ {},
+        /* .params      = */ params,
+        /* .grmr        = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
+        /* .chain       = */ llama_sampler_chain_init(lparams),
+        /* .prev        = */ ring_buffer<llama_token>(std::max(32, std::max(params.n_prev, params.penalty_last_n))),
+        /* .cur         = */ {},
+        /* .cur_p       = */ {},
+        /* .mask        = */ {},
+        /* .masked      = */ {},
+        /* .first_top_k = */ 0,
+        /* .first_min_p = */ 0.0f,
+        /* .keep        = */ {},
     };
 
+    if (params.mirostat == 0 && !params.samplers.empty()) {
+        // the chain runs logit bias and penalties first, which only change the logits of a few known tokens
+        if (params.samplers[0] == COMMON_SAMPLER_TYPE_TOP_K && params.top_k > 0) {
+            result->first_top_k = params.top_k;
+        }
+        if (params.samplers[0] == COMMON_SAMPLER_TYPE_MIN_P && params.min_p > 0.0f) {
+            result->first_min_p = params.min_p;
+        }
+    }
+
     llama_sampler_chain_add(result->chain,
             llama_sampler_init_logit_bias(
                 llama_n_vocab(model),
@@ -244,12 +341,17 @@ void common_sampler_reset(struct common_sampler * gsmpl) {
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
     return new common_sampler {
-        /* .params = */ gsmpl->params,
-        /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
-        /* .chain  = */ llama_sampler_clone(gsmpl->chain),
-        /* .prev   = */ gsmpl->prev,
-        /* .cur    = */ gsmpl->cur,
-        /* .cur_p  = */ gsmpl->cur_p,
+        /* .params      = */ gsmpl->params,
+        /* .grmr        = */ llama_sampler_clone(gsmpl->grmr),
+        /* .chain       = */ llama_sampler_clone(gsmpl->chain),
+        /* .prev        = */ gsmpl->prev,
+        /* .cur         = */ gsmpl->cur,
+        /* .cur_p       = */ gsmpl->cur_p,
+        /* .mask        = */ {},
+        /* .masked      = */ {},
+        /* .first_top_k = */ gsmpl->first_top_k,
+        /* .first_min_p = */ gsmpl->first_min_p,
+        /* .keep        = */ {},
     };
 }
 
@@ -264,15 +366,15 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, struct llama_context * ctx, const float * logits, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
     auto & cur_p = gsmpl->cur_p; // initialized by set_logits
 
     if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
+        gsmpl->set_logits_grammar(ctx, logits);
+    } else {
+        gsmpl->set_logits(ctx, logits);
     }
 
     llama_sampler_apply(chain, &cur_p);
@@ -300,9 +402,8 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits_grammar(ctx, logits);
 
-    llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during re-sampling - check your sampling configuration");
@@ -310,6 +411,152 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    return common_sampler_sample_logits(gsmpl, ctx, llama_get_logits_ith(ctx, idx), grammar_first);
+}
+
+// the workers wait for a job, and then run its tasks along with the thread that submitted it
+struct common_sampler_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    std::function<void(int)> job;
+
+    int  n_tasks  = 0;
+    int  n_active = 0;  // workers that have not finished the current job
+    int  job_id   = 0;
+    bool stop     = false;
+
+    std::atomic<int> next_task;
+
+    void run_tasks() {
+        while (true) {
+            const int i = next_task++;
+            if (i >= n_tasks) {
+                break;
+            }
+            job(i);
+        }
+    }
+
+    void worker_loop() {
+        int job_id_last = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_job.wait(lock, [&]{ return stop || job_id != job_id_last; });
+
+                if (stop) {
+                    return;
+                }
+
+                job_id_last = job_id;
+            }
+
+            run_tasks();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (--n_active == 0) {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+
+    // runs f(0), ..., f(n - 1) on the workers and the calling thread, and waits for them to finish
+    void run(int n, const std::function<void(int)> & f) {
+        if (workers.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            job       = f;
+            n_tasks   = n;
+            n_active  = workers.size();
+            next_task = 0;
+            job_id++;
+        }
+        cv_job.notify_all();
+
+        run_tasks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&]{ return n_active == 0; });
+    }
+};
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads) {
+    auto * pool = new common_sampler_pool;
+
+    // the calling thread is one of the threads
+    for (int i = 1; i < n_threads; ++i) {
+        pool->workers.emplace_back(&common_sampler_pool::worker_loop, pool);
+    }
+
+    return pool;
+}
+
+void common_sampler_pool_free(struct common_sampler_pool * pool) {
+    if (!pool) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+    }
+    pool->cv_job.notify_all();
+
+    for (auto & worker : pool->workers) {
+        worker.join();
+    }
+
+    delete pool;
+}
+
+std::vector<llama_token> common_sampler_sample_batch(
+        struct common_sampler_pool * pool,
+        const std::vector<struct common_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n = gsmpls.size();
+
+    // the rows of the logits are resolved here, as llama_get_logits_ith synchronizes the context
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; ++i) {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n);
+
+    auto sample = [&](int i) {
+        result[i] = common_sampler_sample_logits(gsmpls[i], ctx, logits[i], grammar_first);
+    };
+
+    if (pool) {
+        pool->run(n, sample);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            sample(i);
+        }
+    }
+
+    return result;
+}
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
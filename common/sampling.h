@@ -60,6 +60,23 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// thread pool for sampling multiple sequences in parallel
+struct common_sampler_pool;
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads);
+
+void common_sampler_pool_free(struct common_sampler_pool * pool);
+
+// sample a token with each of the samplers, from the idxs[i]-th output of the last evaluation
+// same as calling common_sampler_sample for each of them, spread over the threads of the pool (serial if pool is NULL)
+// the samplers must be distinct and the context must not be used by other threads meanwhile
+std::vector<llama_token> common_sampler_sample_batch(
+        struct common_sampler_pool * pool,
+        const std::vector<struct common_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first = false);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
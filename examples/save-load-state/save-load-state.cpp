@@ -248,6 +248,77 @@ int main(int argc, char ** argv) {
 
     printf("\n");
 
+    // incremental snapshot of the generated tokens, applied on top of the prompt
+    {
+        std::vector<uint8_t> seq_full(llama_state_seq_get_size(ctx3, 1));
+        llama_state_seq_get_data(ctx3, seq_full.data(), seq_full.size(), 1);
+
+        std::vector<uint8_t> seq_delta(llama_state_seq_get_size_delta(ctx3, 1, n_past_saved));
+        const size_t ncopy = llama_state_seq_get_data_delta(ctx3, seq_delta.data(), seq_delta.size(), 1, n_past_saved);
+        if (ncopy != seq_delta.size()) {
+            fprintf(stderr, "\n%s : seq delta data length %zd does not match expected length %zd\n", __func__, ncopy, seq_delta.size());
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 delta copied, %zd bytes (full: %zd bytes)\n", __func__, ncopy, seq_full.size());
+
+        // keep only the prompt
+        llama_kv_cache_seq_rm(ctx3, 1, n_past_saved, -1);
+
+        const size_t nset = llama_state_seq_set_data_delta(ctx3, seq_delta.data(), seq_delta.size(), 1);
+        if (nset != seq_delta.size()) {
+            fprintf(stderr, "\n%s : seq delta set data length %zd does not match expected length %zd\n", __func__, nset, seq_delta.size());
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+
+        std::vector<uint8_t> seq_restored(llama_state_seq_get_size(ctx3, 1));
+        llama_state_seq_get_data(ctx3, seq_restored.data(), seq_restored.size(), 1);
+
+        if (seq_restored != seq_full) {
+            fprintf(stderr, "\n%s : error : the seq restored from the delta is different\n", __func__);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 restored from delta\n", __func__);
+    }
+
+    // compressed copy of seq 1 into seq 2
+    {
+        std::vector<uint8_t> seq_comp(llama_state_seq_get_size_ext(ctx3, 1, LLAMA_STATE_SEQ_FLAGS_COMPRESS));
+        const size_t ncopy = llama_state_seq_get_data_ext(ctx3, seq_comp.data(), seq_comp.size(), 1, LLAMA_STATE_SEQ_FLAGS_COMPRESS);
+        if (ncopy != seq_comp.size()) {
+            fprintf(stderr, "\n%s : compressed seq data length %zd does not match expected length %zd\n", __func__, ncopy, seq_comp.size());
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 1 compressed, %zd bytes (uncompressed: %zd bytes)\n", __func__, ncopy, llama_state_seq_get_size(ctx3, 1));
+
+        const size_t nset = llama_state_seq_set_data_ext(ctx3, seq_comp.data(), seq_comp.size(), 2, LLAMA_STATE_SEQ_FLAGS_COMPRESS);
+        if (nset != seq_comp.size() || llama_kv_cache_seq_pos_max(ctx3, 2) != llama_kv_cache_seq_pos_max(ctx3, 1)) {
+            fprintf(stderr, "\n%s : error : failed to restore the compressed seq\n", __func__);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : seq 2 restored from compressed seq 1\n", __func__);
+
+        // a state with another header must be rejected without touching the destination sequence
+        seq_comp[0] ^= 0xff;
+        if (llama_state_seq_set_data_ext(ctx3, seq_comp.data(), seq_comp.size(), 2, LLAMA_STATE_SEQ_FLAGS_COMPRESS) != 0 ||
+            llama_kv_cache_seq_pos_max(ctx3, 2) != llama_kv_cache_seq_pos_max(ctx3, 1)) {
+            fprintf(stderr, "\n%s : error : a compressed seq with a bad header was not rejected\n", __func__);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s : compressed seq with a bad header rejected\n", __func__);
+    }
+
     llama_sampler_free(smpl);
     llama_sampler_free(smpl2);
     llama_sampler_free(smpl3);
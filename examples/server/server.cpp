@@ -35,7 +35,9 @@
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
+#include <cstdio>
 #include <deque>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -82,6 +84,13 @@ enum server_task_inf_type {
     SERVER_TASK_INF_TYPE_INFILL,
 };
 
+// the priority classes of the inference tasks, a request can only select a class below the default one
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_BACKGROUND  = -2,
+    SERVER_TASK_PRIORITY_BATCH       = -1,
+    SERVER_TASK_PRIORITY_INTERACTIVE =  0,
+};
+
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_target = -1; // used by SERVER_TASK_TYPE_CANCEL
@@ -92,6 +101,11 @@ struct server_task {
 
     server_task_inf_type inf_type = SERVER_TASK_INF_TYPE_COMPLETION;
 
+    // scheduling of the inference tasks that wait for a slot
+    int         priority   = SERVER_TASK_PRIORITY_INTERACTIVE; // tasks with a higher priority are assigned a slot first
+    int64_t     t_deadline = -1; // if positive, the task is rejected if it has not been assigned a slot by this time (us)
+    std::string client;          // the API key of the request - the clients with fewer tasks in progress go first
+
     // utility function
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
@@ -120,7 +134,7 @@ struct slot_params {
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // mininum line indentation for the generated text in number of whitespace characters
 
-    int64_t t_max_prompt_ms  = -1; // TODO: implement
+    int64_t t_max_prompt_ms  = -1; // if positive, target time from the slot assignment to the end of the prompt processing, used to order the prompts
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
     std::vector<std::string> antiprompt;
@@ -130,6 +144,9 @@ struct server_slot {
     int id;
     int id_task = -1;
 
+    // the client of the task, see server_task::client
+    std::string client;
+
     // the index relative to completion multi-task request
     size_t index = 0;
 
@@ -187,6 +204,7 @@ struct server_slot {
     size_t n_sent_text        = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_start_task; // when the task was assigned to the slot, used to order the prompt processing
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -366,13 +384,25 @@ struct server_metrics {
 };
 
 struct server_queue {
-    int id = 0;
-    bool running;
+    std::atomic<int>  id      { 0 };
+    std::atomic<bool> running { false };
+
+    // tasks are posted by the HTTP threads to lock-free stacks, from which the main loop collects them
+    struct node {
+        server_task task;
+        node * next;
+    };
+
+    std::atomic<node *> posted       { nullptr };
+    std::atomic<node *> posted_front { nullptr };
 
-    // queues
+    // queues - only accessed by the thread running start_loop()
     std::deque<server_task> queue_tasks;
     std::deque<server_task> queue_tasks_deferred;
 
+    // used only to wake up the main loop when it is waiting for tasks
+    std::atomic<bool> waiting { false };
+
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
@@ -380,53 +410,51 @@ struct server_queue {
     std::function<void(server_task&)> callback_new_task;
     std::function<void(void)>         callback_update_slots;
 
+    ~server_queue() {
+        for (node * head : { posted.exchange(nullptr), posted_front.exchange(nullptr) }) {
+            while (head) {
+                node * next = head->next;
+                delete head;
+                head = next;
+            }
+        }
+    }
+
     // Add a new task to the end of the queue
     int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (task.id == -1) {
             task.id = id++;
         }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
+        const int id_task = task.id;
+        QUE_DBG("new task, id = %d, front = %d\n", id_task, front);
+        push(front ? posted_front : posted, std::move(task));
+        notify();
+        return id_task;
     }
 
     // multi-task version of post()
     int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         for (auto & task : tasks) {
             if (task.id == -1) {
                 task.id = id++;
             }
             QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+            push(front ? posted_front : posted, std::move(task));
         }
-        condition_tasks.notify_one();
+        notify();
         return 0;
     }
 
     // Add a new task, but defer until one slot is available
+    // must be called from the main loop
     void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         QUE_DBG("defer task, id = %d\n", task.id);
         queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
     }
 
     // Get the next id for creating a new task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return id++;
     }
 
     // Register function to process a new task
@@ -439,20 +467,95 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+    // true if the deferred task a is to be assigned a slot before b:
+    // first by priority, then by the number of tasks in progress of the client, then by deadline, then in order of arrival
+    static bool deferred_before(const server_task & a, const server_task & b, const std::unordered_map<std::string, int> & n_tasks_client) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+
+        const auto it_a = n_tasks_client.find(a.client);
+        const auto it_b = n_tasks_client.find(b.client);
+        const int n_a = it_a == n_tasks_client.end() ? 0 : it_a->second;
+        const int n_b = it_b == n_tasks_client.end() ? 0 : it_b->second;
+        if (n_a != n_b) {
+            return n_a < n_b;
+        }
+
+        const int64_t t_a = a.t_deadline > 0 ? a.t_deadline : INT64_MAX;
+        const int64_t t_b = b.t_deadline > 0 ? b.t_deadline : INT64_MAX;
+        if (t_a != t_b) {
+            return t_a < t_b;
+        }
+
+        return a.id < b.id;
+    }
+
+    // Call when the state of one slot is changed, it will move the next deferred task to the main queue
+    // must be called from the main loop
+    void pop_deferred_task(const std::unordered_map<std::string, int> & n_tasks_client) {
         if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            auto it = std::min_element(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [&](const server_task & a, const server_task & b) {
+                return deferred_before(a, b, n_tasks_client);
+            });
+            queue_tasks.emplace_back(std::move(*it));
+            queue_tasks_deferred.erase(it);
         }
-        condition_tasks.notify_one();
+    }
+
+    // remove the deferred task that would be assigned a slot last
+    // must be called from the main loop
+    server_task pop_deferred_task_last(const std::unordered_map<std::string, int> & n_tasks_client) {
+        GGML_ASSERT(!queue_tasks_deferred.empty());
+
+        auto it = std::max_element(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [&](const server_task & a, const server_task & b) {
+            return deferred_before(a, b, n_tasks_client);
+        });
+        server_task task = std::move(*it);
+        queue_tasks_deferred.erase(it);
+
+        return task;
+    }
+
+    // remove a task that has not been assigned a slot yet, so that it does not count toward the max queue size
+    // returns false if the task is not queued
+    // must be called from the main loop
+    bool remove_task(int id_task) {
+        for (auto * queue : { &queue_tasks, &queue_tasks_deferred }) {
+            auto it = std::find_if(queue->begin(), queue->end(), [&](const server_task & task) {
+                return task.id == id_task;
+            });
+            if (it != queue->end()) {
+                QUE_DBG("remove task, id = %d\n", id_task);
+                queue->erase(it);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // remove the deferred tasks whose deadline has passed
+    // must be called from the main loop
+    std::vector<server_task> pop_deferred_tasks_expired(int64_t t_now) {
+        std::vector<server_task> expired;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ) {
+            if (it->t_deadline > 0 && it->t_deadline < t_now) {
+                expired.push_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        return expired;
     }
 
     // end the start_loop routine
     void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         running = false;
+
+        std::unique_lock<std::mutex> lock(mutex_tasks);
         condition_tasks.notify_all();
     }
 
@@ -470,14 +573,12 @@ struct server_queue {
             QUE_DBG("%s", "processing new tasks\n");
 
             while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
+                collect();
                 if (queue_tasks.empty()) {
-                    lock.unlock();
                     break;
                 }
-                server_task task = queue_tasks.front();
+                server_task task = std::move(queue_tasks.front());
                 queue_tasks.pop_front();
-                lock.unlock();
 
                 QUE_DBG("processing task, id = %d\n", task.id);
                 callback_new_task(task);
@@ -489,46 +590,99 @@ struct server_queue {
             callback_update_slots();
 
             QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
+            if (queue_tasks.empty()) {
+                waiting = true;
+
+                // a task posted before this point is seen here, and the poster of a later one sees waiting == true
+                if (!has_posted()) {
                     if (!running) {
                         QUE_DBG("%s", "terminate\n");
                         return;
                     }
+                    std::unique_lock<std::mutex> lock(mutex_tasks);
                     condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
+                        return (has_posted() || !running);
                     });
                 }
+
+                waiting = false;
             }
         }
     }
+
+    static void push(std::atomic<node *> & head, server_task && task) {
+        node * n = new node { std::move(task), head.load(std::memory_order_relaxed) };
+        while (!head.compare_exchange_weak(n->next, n)) {
+        }
+    }
+
+    // the nodes of a stack, the most recently pushed first
+    static std::vector<node *> take(std::atomic<node *> & head) {
+        std::vector<node *> nodes;
+        for (node * n = head.exchange(nullptr); n; n = n->next) {
+            nodes.push_back(n);
+        }
+        return nodes;
+    }
+
+    bool has_posted() const {
+        return posted.load() != nullptr || posted_front.load() != nullptr;
+    }
+
+    void notify() {
+        if (waiting.load()) {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            condition_tasks.notify_one();
+        }
+    }
+
+    // move the posted tasks to the queue, the high-priority ones in front of the others
+    void collect() {
+        const std::vector<node *> back = take(posted);
+        for (auto it = back.rbegin(); it != back.rend(); ++it) {
+            queue_tasks.push_back(std::move((*it)->task));
+            delete *it;
+        }
+
+        for (node * n : take(posted_front)) {
+            queue_tasks.push_front(std::move(n->task));
+            delete n;
+        }
+    }
 };
 
 struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // the results of the tasks of one waiter, e.g. all the tasks of a request
+    struct channel {
+        std::deque<server_task_result> results;
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+
+    // for keeping track of all tasks waiting for the result, and the channel of their waiter
+    std::unordered_map<int, std::shared_ptr<channel>> waiting_task_ids;
 
+    // protects waiting_task_ids only - results are delivered under the lock of their channel
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        waiting_task_ids[id_task] = std::make_shared<channel>();
     }
 
+    // the tasks share a channel, so that recv() can wait for any of them
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto chan = std::make_shared<channel>();
+
         std::unique_lock<std::mutex> lock(mutex_results);
 
         for (const auto & task : tasks) {
             SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            waiting_task_ids[task.id] = chan;
         }
     }
 
@@ -550,23 +704,27 @@ struct server_response {
     }
 
     // This function blocks the thread until there is a response for one of the id_tasks
+    // the id_tasks must have been added together with add_waiting_tasks(), or be a single task
     server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
+        std::shared_ptr<channel> chan;
+        {
             std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+            for (const auto & id_task : id_tasks) {
+                const auto it = waiting_task_ids.find(id_task);
+                GGML_ASSERT(it != waiting_task_ids.end() && "recv() called for a task that is not waiting");
+                GGML_ASSERT((!chan || it->second == chan) && "recv() called for tasks that do not share a channel");
+                chan = it->second;
             }
         }
 
-        // should never reach here
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        chan->condition.wait(lock, [&]{
+            return !chan->results.empty();
+        });
+
+        server_task_result res = std::move(chan->results.front());
+        chan->results.pop_front();
+        return res;
     }
 
     // single-task version of recv()
@@ -579,15 +737,325 @@ struct server_response {
     void send(server_task_result & result) {
         SRV_DBG("sending result for task id = %d\n", result.id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
-
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
+        std::shared_ptr<channel> chan;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            const auto it = waiting_task_ids.find(result.id);
+            if (it == waiting_task_ids.end()) {
                 return;
             }
+            chan = it->second;
+        }
+
+        SRV_DBG("task id = %d moved to result queue\n", result.id);
+
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        chan->results.push_back(std::move(result));
+        chan->condition.notify_one();
+    }
+};
+
+// KV cache of sequences that are no longer resident in the llama_context
+// the state is kept in host memory up to a budget, after which the least recently spilled entries are written to
+// disk by a background thread. a slot that receives a prompt sharing a longer prefix with an entry than with its
+// own cache restores the entry instead of evaluating the prompt again
+struct server_kv_tier {
+    struct entry {
+        int id;
+
+        llama_tokens tokens;
+
+        std::shared_ptr<std::vector<uint8_t>> data; // nullptr once the entry has been written to disk
+
+        std::string path; // non-empty once the entry has been queued for writing to disk
+
+        size_t  size    = 0;
+        int64_t t_spill = 0;
+    };
+
+    struct write_job {
+        int id;
+
+        std::string path;
+
+        std::shared_ptr<std::vector<uint8_t>> data;
+
+        bool ok = false;
+    };
+
+    size_t      ram_max = 0; // host memory budget in bytes
+    std::string path;        // directory for the entries that do not fit in host memory
+
+    size_t ram_used    = 0; // host memory held by the entries
+    size_t ram_pending = 0; // part of ram_used that is queued for writing to disk
+
+    int id_next = 0;
+
+    const int64_t t_start = ggml_time_us();
+
+    std::vector<entry> entries;
+
+    // background writer
+    bool running = false;
+    std::thread worker;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<write_job> queue_write;
+    std::vector<write_job> queue_done;
+
+    ~server_kv_tier() {
+        if (running) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                running = false;
+            }
+            condition.notify_all();
+            worker.join();
+        }
+
+        collect();
+
+        for (const auto & e : entries) {
+            if (!e.path.empty()) {
+                std::remove(e.path.c_str());
+            }
+        }
+    }
+
+    bool enabled() const {
+        return ram_max > 0 || !path.empty();
+    }
+
+    void init(size_t ram_max_, const std::string & path_) {
+        ram_max = ram_max_;
+        path    = path_;
+
+        if (!path.empty()) {
+            running = true;
+            worker  = std::thread(&server_kv_tier::worker_loop, this);
+        }
+
+        SRV_INF("kv offload: ram budget = %.2f MiB, path = '%s'\n", ram_max / 1024.0 / 1024.0, path.c_str());
+    }
+
+    // copy the KV cache of seq_id to host memory, keyed by the tokens it holds
+    // call evict() afterwards to enforce the budget
+    void spill(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens) {
+        collect();
+
+        // entries that are a prefix of the new one are redundant
+        for (size_t i = 0; i < entries.size(); ) {
+            if (longest_common_prefix(entries[i].tokens, tokens) == entries[i].tokens.size()) {
+                erase(i);
+            } else {
+                i++;
+            }
+        }
+
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
+        if (size > ram_max && path.empty()) {
+            return;
+        }
+
+        auto data = std::make_shared<std::vector<uint8_t>>(size);
+        if (llama_state_seq_get_data(ctx, data->data(), data->size(), seq_id) != size) {
+            SRV_WRN("kv offload: failed to copy the kv cache of seq %d\n", seq_id);
+            return;
+        }
+
+        entry e;
+        e.id      = id_next++;
+        e.tokens  = tokens;
+        e.data    = std::move(data);
+        e.size    = size;
+        e.t_spill = ggml_time_us();
+
+        SRV_DBG("kv offload: spilled seq %d, id = %d, n_tokens = %zu, size = %.2f MiB\n", seq_id, e.id, e.tokens.size(), size / 1024.0 / 1024.0);
+
+        ram_used += size;
+        entries.push_back(std::move(e));
+    }
+
+    // id of the entry that shares the longest prefix with tokens, if it is longer than n_min
+    int find(const llama_tokens & tokens, size_t n_min, size_t & n_lcp) const {
+        int ret = -1;
+
+        n_lcp = n_min;
+        for (const auto & e : entries) {
+            const size_t n = longest_common_prefix(e.tokens, tokens);
+            if (n > n_lcp) {
+                n_lcp = n;
+                ret   = e.id;
+            }
+        }
+
+        return ret;
+    }
+
+    // load the entry into seq_id and remove it from the tier
+    // on failure, seq_id is left empty
+    bool restore(llama_context * ctx, int id, llama_seq_id seq_id, llama_tokens & tokens) {
+        size_t idx = 0;
+        while (idx < entries.size() && entries[idx].id != id) {
+            idx++;
+        }
+
+        if (idx == entries.size()) {
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            return false;
+        }
+
+        entry & e = entries[idx];
+
+        std::shared_ptr<std::vector<uint8_t>> data = e.data;
+        if (!data) {
+            data = std::make_shared<std::vector<uint8_t>>(e.size);
+
+            std::ifstream file(e.path, std::ios::binary);
+            if (!file.read((char *) data->data(), data->size())) {
+                SRV_WRN("kv offload: failed to read '%s'\n", e.path.c_str());
+                erase(idx);
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+                return false;
+            }
+        }
+
+        const bool ok = llama_state_seq_set_data(ctx, data->data(), data->size(), seq_id) == e.size;
+        if (ok) {
+            SRV_DBG("kv offload: restored seq %d, id = %d, n_tokens = %zu\n", seq_id, e.id, e.tokens.size());
+
+            tokens = std::move(e.tokens);
+        }
+
+        erase(idx);
+
+        return ok;
+    }
+
+    void erase(size_t idx) {
+        const entry & e = entries[idx];
+
+        if (e.data) {
+            ram_used -= e.size;
+
+            if (!e.path.empty()) {
+                // still being written - the file is removed by collect()
+                ram_pending -= e.size;
+            }
+        } else if (!e.path.empty()) {
+            std::remove(e.path.c_str());
+        }
+
+        entries.erase(entries.begin() + idx);
+    }
+
+    // queue the oldest entries in host memory for writing to disk (or drop them) until the budget is met
+    void evict() {
+        while (ram_used - ram_pending > ram_max) {
+            int idx = -1;
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (entries[i].data && entries[i].path.empty() && (idx == -1 || entries[i].t_spill < entries[idx].t_spill)) {
+                    idx = i;
+                }
+            }
+
+            if (idx == -1) {
+                break;
+            }
+
+            entry & e = entries[idx];
+
+            if (path.empty()) {
+                SRV_DBG("kv offload: dropped id = %d\n", e.id);
+                erase(idx);
+                continue;
+            }
+
+            e.path = path + "kv-offload-" + std::to_string(t_start) + "-" + std::to_string(e.id) + ".bin";
+            ram_pending += e.size;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                write_job job;
+                job.id   = e.id;
+                job.path = e.path;
+                job.data = e.data;
+
+                queue_write.push_back(std::move(job));
+            }
+            condition.notify_one();
+        }
+    }
+
+    // release the host memory of the entries that have been written to disk
+    void collect() {
+        std::vector<write_job> done;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.swap(queue_done);
+        }
+
+        for (const auto & job : done) {
+            size_t idx = 0;
+            while (idx < entries.size() && entries[idx].id != job.id) {
+                idx++;
+            }
+
+            if (idx == entries.size()) {
+                // the entry was restored or replaced in the meantime
+                std::remove(job.path.c_str());
+                continue;
+            }
+
+            entry & e = entries[idx];
+
+            if (!job.ok) {
+                SRV_WRN("kv offload: failed to write '%s'\n", job.path.c_str());
+                std::remove(job.path.c_str());
+                e.path.clear();
+                ram_pending -= e.size;
+                erase(idx);
+                continue;
+            }
+
+            SRV_DBG("kv offload: wrote id = %d to '%s'\n", e.id, e.path.c_str());
+
+            e.data.reset();
+            ram_used    -= e.size;
+            ram_pending -= e.size;
+        }
+    }
+
+    void worker_loop() {
+        while (true) {
+            write_job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]{
+                    return !running || !queue_write.empty();
+                });
+
+                if (!running) {
+                    return;
+                }
+
+                job = std::move(queue_write.front());
+                queue_write.pop_front();
+            }
+
+            {
+                std::ofstream file(job.path, std::ios::binary);
+                job.ok = file.write((const char *) job.data->data(), job.data->size()) && file.flush();
+            }
+
+            job.data.reset();
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queue_done.push_back(std::move(job));
+            }
         }
     }
 };
@@ -616,6 +1084,11 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_kv_tier kv_tier;
+
+    // threads for sampling the slots that generate a token in the same batch
+    common_sampler_pool * smpl_pool = nullptr;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -637,6 +1110,8 @@ struct server_context {
             }
         }
 
+        common_sampler_pool_free(smpl_pool);
+
         llama_batch_free(batch);
     }
 
@@ -691,8 +1166,9 @@ struct server_context {
 
             slot.sparams = params.sparams;
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
+            slot.callback_on_release = [this](int id_slot) {
+                spill_slot(*get_slot_by_id(id_slot));
+                queue_tasks.pop_deferred_task(get_n_tasks_client());
             };
 
             slot.reset();
@@ -713,6 +1189,55 @@ struct server_context {
         }
 
         metrics.init();
+
+        // sampling runs between the decodes, so it can use the threads of the generation
+        {
+            const int n_threads = std::min(params.cpuparams.n_threads, params.n_parallel);
+            if (n_threads > 1) {
+                smpl_pool = common_sampler_pool_init(n_threads);
+            }
+        }
+
+        if (params.kv_offload_ram > 0 || !params.kv_offload_path.empty()) {
+            kv_tier.init((size_t) params.kv_offload_ram*1024*1024, params.kv_offload_path);
+        }
+    }
+
+    // number of tasks in progress for each client, for the fair scheduling of the deferred tasks
+    std::unordered_map<std::string, int> get_n_tasks_client() const {
+        std::unordered_map<std::string, int> n_tasks_client;
+        for (const server_slot & slot : slots) {
+            if (slot.is_processing()) {
+                n_tasks_client[slot.client]++;
+            }
+        }
+
+        return n_tasks_client;
+    }
+
+    // defer the task until a slot is available
+    // if the queue is full, the task that would be assigned a slot last is rejected - possibly this one
+    void defer_task(const server_task & task) {
+        queue_tasks.defer(task);
+
+        if (params.n_max_queue > 0 && queue_tasks.queue_tasks_deferred.size() > (size_t) params.n_max_queue) {
+            const server_task rejected = queue_tasks.pop_deferred_task_last(get_n_tasks_client());
+
+            SRV_WRN("too many deferred tasks, rejecting task, id_task = %d, priority = %d\n", rejected.id, rejected.priority);
+
+            send_error(rejected, "the server is busy, too many requests are waiting for a slot", ERROR_TYPE_TOO_MANY_REQUESTS);
+        }
+    }
+
+    // keep the KV cache of a slot that goes idle in the offload tier, so that a later request can restore it once the
+    // slot has been given another prompt - the copy is made here rather than when the next prompt arrives
+    void spill_slot(server_slot & slot) {
+        if (!kv_tier.enabled() || !slot.params.cache_prompt || slot.cache_tokens.empty()) {
+            return;
+        }
+
+        kv_tier.spill(ctx, slot.id + 1, slot.cache_tokens);
+        kv_tier.evict();
     }
 
     server_slot * get_slot_by_id(int id) {
@@ -827,7 +1352,7 @@ struct server_context {
         slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
         slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
         slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
-      //slot.params.t_max_prompt_ms    = json_value(data, "t_max_prompt_ms",   default_params.t_max_prompt_ms); // TODO: implement
+        slot.params.t_max_prompt_ms    = json_value(data, "t_max_prompt_ms",   default_params.t_max_prompt_ms);
         slot.params.t_max_predict_ms   = json_value(data, "t_max_predict_ms",  default_params.t_max_predict_ms);
 
         // process "json_schema" and "grammar"
@@ -933,6 +1458,7 @@ struct server_context {
         }
 
         slot.state = SLOT_STATE_STARTED;
+        slot.t_start_task = ggml_time_us();
 
         SLT_INF(slot, "%s", "processing task\n");
 
@@ -1345,7 +1871,7 @@ struct server_context {
     //
 
     // break the input "prompt" into multiple tasks if needed, then format and tokenize the input prompt(s)
-    std::vector<server_task> create_tasks_inference(json data, server_task_inf_type inf_type) {
+    std::vector<server_task> create_tasks_inference(json data, server_task_inf_type inf_type, const std::string & client = "") {
         std::vector<server_task> tasks;
         auto create_task = [&](json & task_data, llama_tokens & prompt_tokens) {
             SRV_DBG("create task, n_tokens = %d\n", (int) prompt_tokens.size());
@@ -1355,6 +1881,17 @@ struct server_context {
             task.type          = SERVER_TASK_TYPE_INFERENCE;
             task.data          = task_data;
             task.prompt_tokens = std::move(prompt_tokens);
+            // a request can only lower its own priority, so that it cannot bypass the fairness between the API keys
+            task.priority      = std::min(std::max(json_value(task_data, "priority", (int) SERVER_TASK_PRIORITY_INTERACTIVE),
+                                                   (int) SERVER_TASK_PRIORITY_BACKGROUND),
+                                          (int) SERVER_TASK_PRIORITY_INTERACTIVE);
+            task.client        = client;
+
+            const int64_t t_max_queue_ms = json_value(task_data, "t_max_queue_ms", (int64_t) -1);
+            if (t_max_queue_ms > 0) {
+                task.t_deadline = ggml_time_us() + 1000*t_max_queue_ms;
+            }
+
             tasks.push_back(std::move(task));
         };
 
@@ -1504,19 +2041,20 @@ struct server_context {
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
+                        defer_task(task);
                         break;
                     }
                     if (slot->is_processing()) {
                         // if requested slot is unavailable, we defer this task for processing later
                         SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                        queue_tasks.defer(task);
+                        defer_task(task);
                         break;
                     }
 
                     slot->reset();
 
                     slot->id_task       = task.id;
+                    slot->client        = task.client;
                     slot->inf_type      = task.inf_type;
                     slot->index         = json_value(task.data, "index", 0);
                     slot->prompt_tokens = std::move(task.prompt_tokens);
@@ -1528,6 +2066,11 @@ struct server_context {
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
+                    // drop the task if it is still waiting for a slot
+                    if (queue_tasks.remove_task(task.id_target)) {
+                        break;
+                    }
+
                     // release slot linked with the task id
                     for (auto & slot : slots) {
                         if (slot.id_task == task.id_target) {
@@ -1741,6 +2284,11 @@ struct server_context {
     }
 
     void update_slots() {
+        // reject the deferred tasks that could not be assigned a slot in time
+        for (const auto & task : queue_tasks.pop_deferred_tasks_expired(ggml_time_us())) {
+            send_error(task, "the request timed out waiting for an available slot", ERROR_TYPE_UNAVAILABLE);
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -1842,8 +2390,36 @@ struct server_context {
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
         // next, batch any pending prompts without exceeding n_batch
+        // while slots are generating, the prompt tokens are limited to the prefill budget, so that a long prompt is
+        // processed in chunks over several batches instead of delaying the next token of every generating slot
+        int32_t n_batch_prompt = n_batch;
+        if (batch.n_tokens > 0 && params.n_prefill_budget > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + params.n_prefill_budget);
+        }
+
         if (params.cont_batching || batch.n_tokens == 0) {
+            // the prompts are processed earliest deadline first, the deadline being set by t_max_prompt_ms, and then in
+            // the order in which the tasks were assigned, so that the budget goes to the requests that are the closest to
+            // missing their target or that have waited the longest for their first token
+            std::vector<server_slot *> slots_prompt;
             for (auto & slot : slots) {
+                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                    slots_prompt.push_back(&slot);
+                }
+            }
+
+            std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+                const int64_t t_a = a->params.t_max_prompt_ms > 0 ? a->t_start_task + 1000*a->params.t_max_prompt_ms : INT64_MAX;
+                const int64_t t_b = b->params.t_max_prompt_ms > 0 ? b->t_start_task + 1000*b->params.t_max_prompt_ms : INT64_MAX;
+                if (t_a != t_b) {
+                    return t_a < t_b;
+                }
+                return a->t_start_task < b->t_start_task;
+            });
+
+            for (server_slot * slot_prompt : slots_prompt) {
+                auto & slot = *slot_prompt;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -1931,6 +2507,22 @@ struct server_context {
                             }
 
                             if (slot.params.cache_prompt) {
+                                if (kv_tier.enabled()) {
+                                    const size_t n_lcp = longest_common_prefix(slot.cache_tokens, prompt_tokens);
+
+                                    // the cache of this slot has been spilled when the slot went idle
+                                    size_t n_lcp_tier = 0;
+                                    const int id_entry = kv_tier.find(prompt_tokens, n_lcp, n_lcp_tier);
+
+                                    if (id_entry >= 0) {
+                                        SLT_INF(slot, "restoring kv cache from offload, n_lcp = %zu, n_lcp_offload = %zu\n", n_lcp, n_lcp_tier);
+
+                                        if (!kv_tier.restore(ctx, id_entry, slot.id + 1, slot.cache_tokens)) {
+                                            slot.cache_tokens.clear();
+                                        }
+                                    }
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = longest_common_prefix(slot.cache_tokens, prompt_tokens);
 
@@ -2025,7 +2617,7 @@ struct server_context {
                     slot.cache_tokens.resize(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_prompt) {
                         common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, { slot.id + 1 }, false);
 
                         if (slot.params.cache_prompt) {
@@ -2061,7 +2653,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -2114,6 +2706,11 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // slots that sample a token from this batch view, and the index of their output
+            std::vector<server_slot *>    slots_smpl;
+            std::vector<common_sampler *> smpls;
+            std::vector<int>              idxs;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2141,8 +2738,18 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
+                slots_smpl.push_back(&slot);
+                smpls.push_back(slot.smpl);
+                idxs.push_back(slot.i_batch - i);
+            }
+
+            const std::vector<llama_token> ids = common_sampler_sample_batch(smpl_pool, smpls, ctx, idxs);
+
+            for (size_t k = 0; k < slots_smpl.size(); ++k) {
+                server_slot & slot = *slots_smpl[k];
+
                 completion_token_output result;
-                const llama_token id = common_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                const llama_token id = ids[k];
 
                 common_sampler_accept(slot.smpl, id, true);
 
@@ -2191,6 +2798,11 @@ struct server_context {
     }
 };
 
+// the client of a request, for the fair scheduling of its tasks: the API key, if any
+static std::string get_request_client(const httplib::Request & req) {
+    return req.get_header_value("Authorization");
+}
+
 static void log_server_request(const httplib::Request & req, const httplib::Response & res) {
     // skip GH copilot requests when using default port
     if (req.path == "/v1/health" || req.path == "/v1/completions") {
@@ -2567,8 +3179,11 @@ int main(int argc, char ** argv) {
             { "filepath", filepath },
         };
 
+        // register the waiting task before posting it, the result may arrive before post() returns
+        task.id = ctx_server.queue_tasks.get_new_id();
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
         const int id_task = ctx_server.queue_tasks.post(task);
-        ctx_server.queue_results.add_waiting_task_id(id_task);
 
         server_task_result result = ctx_server.queue_results.recv(id_task);
         ctx_server.queue_results.remove_waiting_task_id(id_task);
@@ -2597,8 +3212,10 @@ int main(int argc, char ** argv) {
             { "filepath", filepath },
         };
 
+        task.id = ctx_server.queue_tasks.get_new_id();
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
         const int id_task = ctx_server.queue_tasks.post(task);
-        ctx_server.queue_results.add_waiting_task_id(id_task);
 
         server_task_result result = ctx_server.queue_results.recv(id_task);
         ctx_server.queue_results.remove_waiting_task_id(id_task);
@@ -2617,8 +3234,10 @@ int main(int argc, char ** argv) {
             { "id_slot", id_slot },
         };
 
+        task.id = ctx_server.queue_tasks.get_new_id();
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
         const int id_task = ctx_server.queue_tasks.post(task);
-        ctx_server.queue_results.add_waiting_task_id(id_task);
 
         server_task_result result = ctx_server.queue_results.recv(id_task);
         ctx_server.queue_results.remove_waiting_task_id(id_task);
@@ -2682,13 +3301,13 @@ int main(int argc, char ** argv) {
         res_ok(res, {{ "success", true }});
     };
 
-    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok](server_task_inf_type inf_type, json & data, httplib::Response & res) {
+    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok](server_task_inf_type inf_type, json & data, const httplib::Request & req, httplib::Response & res) {
         if (ctx_server.params.embedding || ctx_server.params.reranking) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings` or `--reranking`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, inf_type);
+        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, inf_type, get_request_client(req));
         ctx_server.queue_results.add_waiting_tasks(tasks);
         ctx_server.queue_tasks.post(tasks);
 
@@ -2734,7 +3353,7 @@ int main(int argc, char ** argv) {
 
     const auto handle_completions = [&handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
         json data = json::parse(req.body);
-        return handle_completions_generic(SERVER_TASK_INF_TYPE_COMPLETION, data, res);
+        return handle_completions_generic(SERVER_TASK_INF_TYPE_COMPLETION, data, req, res);
     };
 
     const auto handle_infill = [&ctx_server, &res_error, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
@@ -2784,7 +3403,7 @@ int main(int argc, char ** argv) {
         }
         data["input_extra"] = input_extra; // default to empty array if it's not exist
 
-        return handle_completions_generic(SERVER_TASK_INF_TYPE_INFILL, data, res);
+        return handle_completions_generic(SERVER_TASK_INF_TYPE_INFILL, data, req, res);
     };
 
     // TODO: maybe merge this function with "handle_completions_generic"
@@ -2796,7 +3415,7 @@ int main(int argc, char ** argv) {
 
         json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), params.chat_template);
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, SERVER_TASK_INF_TYPE_COMPLETION);
+        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, SERVER_TASK_INF_TYPE_COMPLETION, get_request_client(req));
         ctx_server.queue_results.add_waiting_tasks(tasks);
         ctx_server.queue_tasks.post(tasks);
 
@@ -2940,7 +3559,7 @@ int main(int argc, char ** argv) {
         json responses = json::array();
         bool error = false;
         {
-            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_EMBEDDING);
+            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_EMBEDDING, get_request_client(req));
             ctx_server.queue_results.add_waiting_tasks(tasks);
             ctx_server.queue_tasks.post(tasks);
 
@@ -3017,7 +3636,7 @@ int main(int argc, char ** argv) {
         json responses = json::array();
         bool error = false;
         {
-            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_RERANK);
+            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_RERANK, get_request_client(req));
             ctx_server.queue_results.add_waiting_tasks(tasks);
             ctx_server.queue_tasks.post(tasks);
 
@@ -3079,8 +3698,10 @@ int main(int argc, char ** argv) {
 
         server_task task;
         task.type = SERVER_TASK_TYPE_SET_LORA;
+        task.id = ctx_server.queue_tasks.get_new_id();
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
         const int id_task = ctx_server.queue_tasks.post(task);
-        ctx_server.queue_results.add_waiting_task_id(id_task);
 
         server_task_result result = ctx_server.queue_results.recv(id_task);
         ctx_server.queue_results.remove_waiting_task_id(id_task);
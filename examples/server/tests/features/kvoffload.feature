@@ -0,0 +1,63 @@
+@llama.cpp
+@kvoffload
+Feature: llama.cpp server KV cache offload of idle slots
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   prompt caching is enabled
+    And   1 slots
+    And   8192 KV cache size
+    And   42 as server seed
+    And   24 max tokens to predict
+
+  Scenario: Restore the KV cache of a prompt from host memory
+    Given 64 MiB of host memory for the KV offload
+    Then  the server is starting
+    Then  the server is healthy
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   22 prompt tokens are processed
+    # the cache of the first prompt is spilled when the slot goes idle, then replaced by the second prompt
+    Given a user prompt "Write a poem about the sea."
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   1 prompt tokens are processed
+
+  Scenario: Restore the KV cache of a prompt from disk
+    Given 0 MiB of host memory for the KV offload
+    And   . as KV offload path
+    Then  the server is starting
+    Then  the server is healthy
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   22 prompt tokens are processed
+    Given a user prompt "Write a poem about the sea."
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   1 prompt tokens are processed
+
+  Scenario: The KV cache of a prompt beyond the host memory budget is not kept
+    Given 1 MiB of host memory for the KV offload
+    Then  the server is starting
+    Then  the server is healthy
+    Given a long user prompt "What is the capital of France?" repeated 150 times
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   more than 1000 prompt tokens are processed
+    Given a user prompt "Write a poem about the sea."
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    Given a long user prompt "What is the capital of France?" repeated 150 times
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    And   more than 1000 prompt tokens are processed
@@ -33,6 +33,37 @@ Feature: Parallel
       | n_predict |
       | 128       |
 
+  Scenario Outline: Many users completion
+    Given <n_prompts> prompts "Write a very long story about AI." with seed 42
+    And   <n_predict> max tokens to predict
+    Given concurrent completion requests
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with <n_predict> tokens
+    Examples:
+      | n_prompts | n_predict |
+      | 16        | 8         |
+      | 32        | 1         |
+
+  Scenario: Multi users completion with several prompts per request
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And a prompt:
+      """
+      Write a very long joke.
+      """
+    And 16 max tokens to predict
+    Given 4 concurrent completion requests with all the prompts
+    Then the server is idle
+    And  all slots are idle
+    Then all the prompts of each request are predicted with 16 tokens
+
   Scenario Outline: Multi users OAI completions compatibility
     Given a system prompt You are a writer.
     And   a model tinyllama-2
@@ -0,0 +1,52 @@
+@llama.cpp
+@queue
+Feature: llama.cpp server requests waiting for a slot
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   1024 KV cache size
+    And   1 slots
+    And   continuous batching
+    And   1 max queued requests
+    And   8 HTTP threads
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Requests beyond the max queue size are rejected
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   4000 max tokens to predict
+    And   concurrent completion requests
+    Then  the server is busy
+    Given a prompt:
+      """
+      Write another very long story.
+      """
+    And   concurrent completion requests
+    Given a prompt:
+      """
+      Write a short poem.
+      """
+    And   a completion request with 429 api error
+    Then  all prompts are predicted
+
+  Scenario: Requests waiting too long for a slot are rejected
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And   4000 max tokens to predict
+    And   concurrent completion requests
+    Then  the server is busy
+    Given a prompt:
+      """
+      Write a short poem.
+      """
+    And   10 milliseconds max queue time
+    And   a completion request with 503 api error
+    Then  all prompts are predicted
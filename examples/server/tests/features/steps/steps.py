@@ -60,9 +60,14 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.n_prompts = 0
     context.n_server_predict = None
     context.slot_save_path = None
+    context.kv_offload_ram = None
+    context.kv_offload_path = None
     context.id_slot = None
     context.cache_prompt = None
     context.n_slots = None
+    context.n_max_queue = None
+    context.n_threads_http = None
+    context.t_max_queue_ms = None
     context.prompt_prefix = None
     context.prompt_suffix = None
     context.server_api_key = None
@@ -157,6 +162,21 @@ def step_n_slots(context, n_slots: int):
     context.n_slots = n_slots
 
 
+@step('{n_max_queue:d} max queued requests')
+def step_n_max_queue(context, n_max_queue: int):
+    context.n_max_queue = n_max_queue
+
+
+@step('{n_threads_http:d} HTTP threads')
+def step_n_threads_http(context, n_threads_http: int):
+    context.n_threads_http = n_threads_http
+
+
+@step('{t_max_queue_ms:d} milliseconds max queue time')
+def step_t_max_queue_ms(context, t_max_queue_ms: int):
+    context.t_max_queue_ms = t_max_queue_ms
+
+
 @step('{n_predict:d} server max tokens to predict')
 def step_server_n_predict(context, n_predict: int):
     context.n_server_predict = n_predict if n_predict > 0 else None
@@ -167,6 +187,16 @@ def step_slot_save_path(context, slot_save_path: str):
     context.slot_save_path = slot_save_path
 
 
+@step('{kv_offload_ram:d} MiB of host memory for the KV offload')
+def step_kv_offload_ram(context, kv_offload_ram: int):
+    context.kv_offload_ram = kv_offload_ram
+
+
+@step('{kv_offload_path} as KV offload path')
+def step_kv_offload_path(context, kv_offload_path: str):
+    context.kv_offload_path = kv_offload_path
+
+
 @step('using slot id {id_slot:d}')
 def step_id_slot(context, id_slot: int):
     context.id_slot = id_slot
@@ -285,7 +315,8 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
                                           id_slot=context.id_slot,
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key,
-                                          temperature=context.temperature)
+                                          temperature=context.temperature,
+                                          t_max_queue_ms=context.t_max_queue_ms)
     context.tasks_result.append(completion)
     if context.debug:
         print(f"Completion response: {completion}")
@@ -373,12 +404,23 @@ def step_impl(context, n_prompt):
     assert n_prompt < 0 or n_prompt == context.completion['timings']['prompt_n'], f"n_prompt={context.completion['timings']['prompt_n']}"
 
 
+@step('more than {n_prompt:d} prompt tokens are processed')
+def step_more_prompt_tokens_processed(context, n_prompt):
+    assert context.completion['timings']['prompt_n'] > n_prompt, f"n_prompt={context.completion['timings']['prompt_n']}"
+
+
 @step('a user prompt {user_prompt}')
 def step_user_prompt(context, user_prompt):
     context.prompts.append(user_prompt)
     context.n_prompts = len(context.prompts)
 
 
+@step('a long user prompt "{user_prompt}" repeated {n_repeat:d} times')
+def step_long_user_prompt(context, user_prompt, n_repeat):
+    context.prompts.append(' '.join([user_prompt] * n_repeat))
+    context.n_prompts = len(context.prompts)
+
+
 @step('a system prompt {system_prompt}')
 def step_system_prompt(context, system_prompt):
     context.system_prompt = system_prompt
@@ -612,6 +654,40 @@ async def step_concurrent_completion_requests(context):
     )
 
 
+@step('{n_requests:d} concurrent completion requests with all the prompts')
+@async_run_until_complete()
+async def step_concurrent_completion_requests_all_prompts(context, n_requests):
+    # each request has several tasks, whose results are received on the channel of the request
+    prompts = context.prompts.copy()
+    context.prompts.clear()
+    context.n_prompts = len(prompts)
+    for _ in range(n_requests):
+        context.concurrent_tasks.append(asyncio.create_task(request_completion(
+            prompts,
+            42,
+            context.base_url,
+            debug=context.debug,
+            n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
+            user_api_key=context.user_api_key if hasattr(context, 'user_api_key') else None,
+            temperature=0.0,
+        )))
+    await asyncio.sleep(0.01)
+
+
+@step('all the prompts of each request are predicted with {n_expected_predicted:d} tokens')
+@async_run_until_complete
+async def step_all_prompts_of_each_request_are_predicted(context, n_expected_predicted):
+    n_requests = await gather_tasks_results(context)
+    assert n_requests > 0
+    for _ in range(n_requests):
+        results = context.tasks_result.pop()
+        assert isinstance(results, list) and len(results) == context.n_prompts, f'{results} must have {context.n_prompts} results'
+        for i, result in enumerate(results):
+            assert result['index'] == i
+            assert_n_tokens_predicted(result, expected_predicted_n=n_expected_predicted)
+    assert len(context.concurrent_tasks) == 0, f"{len(context.concurrent_tasks)} pending requests"
+
+
 @step('concurrent OAI completions requests')
 @async_run_until_complete
 async def step_oai_chat_completions(context):
@@ -1024,7 +1100,8 @@ async def request_completion(prompt,
                              id_slot=None,
                              expect_api_error=None,
                              user_api_key=None,
-                             temperature=None) -> int | dict[str, Any]:
+                             temperature=None,
+                             t_max_queue_ms=None) -> int | dict[str, Any]:
     if debug:
         print(f"Sending completion request: {prompt}")
     origin = "my.super.domain"
@@ -1036,19 +1113,23 @@ async def request_completion(prompt,
             print(f"Set user_api_key: {user_api_key}")
         headers['Authorization'] = f'Bearer {user_api_key}'
 
+    payload = {
+        "input_prefix": prompt_prefix,
+        "prompt": prompt,
+        "input_suffix": prompt_suffix,
+        "n_predict": n_predict if n_predict is not None else -1,
+        "cache_prompt": cache_prompt,
+        "id_slot": id_slot,
+        "seed": seed if seed is not None else 42,
+        "temperature": temperature if temperature is not None else 0.8,
+        "n_probs": 2,
+    }
+    if t_max_queue_ms is not None:
+        payload['t_max_queue_ms'] = t_max_queue_ms
+
     async with aiohttp.ClientSession(timeout=DEFAULT_TIMEOUT_SECONDS) as session:
         async with session.post(f'{base_url}/completion',
-                                json={
-                                    "input_prefix": prompt_prefix,
-                                    "prompt": prompt,
-                                    "input_suffix": prompt_suffix,
-                                    "n_predict": n_predict if n_predict is not None else -1,
-                                    "cache_prompt": cache_prompt,
-                                    "id_slot": id_slot,
-                                    "seed": seed if seed is not None else 42,
-                                    "temperature": temperature if temperature is not None else 0.8,
-                                    "n_probs": 2,
-                                },
+                                json=payload,
                                 headers=headers) as response:
             if expect_api_error is None or not expect_api_error:
                 assert response.status == 200
@@ -1470,10 +1551,18 @@ def start_server_background(context):
         server_args.extend(['--ctx-size', context.n_ctx])
     if context.n_slots:
         server_args.extend(['--parallel', context.n_slots])
+    if context.n_max_queue:
+        server_args.extend(['--max-queue', context.n_max_queue])
+    if context.n_threads_http:
+        server_args.extend(['--threads-http', context.n_threads_http])
     if context.n_server_predict:
         server_args.extend(['--n-predict', context.n_server_predict])
     if context.slot_save_path:
         server_args.extend(['--slot-save-path', context.slot_save_path])
+    if context.kv_offload_ram is not None:
+        server_args.extend(['--kv-offload-ram', context.kv_offload_ram])
+    if context.kv_offload_path:
+        server_args.extend(['--kv-offload-path', context.kv_offload_path])
     if context.server_api_key:
         server_args.extend(['--api-key', context.server_api_key])
     if context.n_ga:
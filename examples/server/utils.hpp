@@ -50,6 +50,7 @@ enum error_type {
     ERROR_TYPE_PERMISSION,
     ERROR_TYPE_UNAVAILABLE, // custom error
     ERROR_TYPE_NOT_SUPPORTED, // custom error
+    ERROR_TYPE_TOO_MANY_REQUESTS, // custom error
 };
 
 template <typename T>
@@ -152,22 +153,46 @@ static llama_tokens tokenize_mixed(const llama_context * ctx, const json & json_
  * - "prompt": [[12, 34, "string", 56, 78], [12, 34, 56]]
  */
 static std::vector<llama_tokens> tokenize_input_prompts(llama_context * ctx, const json & json_prompt, bool add_special, bool parse_special) {
+    // plain strings are tokenized in parallel
+    const llama_model * model = llama_get_model(ctx);
+    const int n_threads = llama_n_threads_batch(ctx);
+
     std::vector<llama_tokens> result;
-    if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
-        // string or mixed
+    if (json_prompt.is_string()) {
+        // string
+        result = common_tokenize_batch(model, { json_prompt.get<std::string>() }, add_special, parse_special, n_threads);
+    } else if (json_is_array_of_mixed_numbers_strings(json_prompt)) {
+        // mixed
         result.push_back(tokenize_mixed(ctx, json_prompt, add_special, parse_special));
     } else if (json_is_array_of_numbers(json_prompt)) {
         // array of tokens
         result.push_back(json_prompt.get<llama_tokens>());
     } else if (json_prompt.is_array()) {
         // array of prompts
-        result.reserve(json_prompt.size());
-        for (const auto & p : json_prompt) {
-            if (p.is_string() || json_is_array_of_mixed_numbers_strings(p)) {
-                result.push_back(tokenize_mixed(ctx, p, add_special, parse_special));
+        std::vector<std::string> texts;
+        std::vector<size_t> text_idxs;
+        for (size_t i = 0; i < json_prompt.size(); ++i) {
+            if (json_prompt[i].is_string()) {
+                texts.push_back(json_prompt[i].get<std::string>());
+                text_idxs.push_back(i);
+            }
+        }
+        std::vector<llama_tokens> texts_tokens = common_tokenize_batch(model, texts, add_special, parse_special, n_threads);
+
+        result.resize(json_prompt.size());
+        for (size_t i = 0; i < text_idxs.size(); ++i) {
+            result[text_idxs[i]] = std::move(texts_tokens[i]);
+        }
+
+        for (size_t i = 0; i < json_prompt.size(); ++i) {
+            const auto & p = json_prompt[i];
+            if (p.is_string()) {
+                // already tokenized
+            } else if (json_is_array_of_mixed_numbers_strings(p)) {
+                result[i] = tokenize_mixed(ctx, p, add_special, parse_special);
             } else if (json_is_array_of_numbers(p)) {
                 // array of tokens
-                result.push_back(p.get<llama_tokens>());
+                result[i] = p.get<llama_tokens>();
             } else {
                 throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, or a list of mixed strings & tokens");
             }
@@ -890,6 +915,10 @@ static json format_error_response(const std::string & message, const enum error_
             type_str = "unavailable_error";
             code = 503;
             break;
+        case ERROR_TYPE_TOO_MANY_REQUESTS:
+            type_str = "too_many_requests_error";
+            code = 429;
+            break;
     }
     return json {
         {"code", code},
@@ -17,7 +17,11 @@ GGML_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * en
 
 GGML_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total);
 
-GGML_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem);
+// cache_dir: if not NULL, tensors larger than 10 MiB are cached on disk by content hash and the
+//            client can skip re-uploading them on subsequent connections
+GGML_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint,
+                                            const char * cache_dir,
+                                            size_t free_mem, size_t total_mem);
 
 GGML_API ggml_backend_reg_t ggml_backend_rpc_reg(void);
 
@@ -7,6 +7,7 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -46,6 +47,11 @@ typedef int sockfd_t;
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+    // graphs cached by the server for this connection: graph hash -> graph id, with the hashes in order of
+    // registration, evicted in the same order as the server does (see MAX_CACHED_GRAPHS)
+    std::unordered_map<uint64_t, uint64_t> graph_ids;
+    std::deque<uint64_t> graph_hashes;
+    uint64_t next_graph_id = 1;
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -93,9 +99,17 @@ enum rpc_cmd {
     RPC_CMD_COPY_TENSOR,
     RPC_CMD_GRAPH_COMPUTE,
     RPC_CMD_GET_DEVICE_MEMORY,
+    RPC_CMD_SET_TENSOR_HASH,
+    RPC_CMD_GRAPH_COMPUTE_CACHED,
     RPC_CMD_COUNT,
 };
 
+// tensors larger than this are sent by hash first, the server may already have them in its cache
+const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
+
+// max number of graphs sent with RPC_CMD_GRAPH_COMPUTE_CACHED kept by the server per client
+const size_t MAX_CACHED_GRAPHS = 8;
+
 struct rpc_msg_alloc_buffer_req {
     uint64_t size;
 };
@@ -130,6 +144,17 @@ struct rpc_msg_buffer_clear_req {
     uint8_t value;
 };
 
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t hash;
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -149,6 +174,11 @@ struct rpc_msg_graph_compute_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_graph_compute_cached_rsp {
+    uint8_t found;
+    uint8_t result;
+};
+
 struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
@@ -331,6 +361,17 @@ static bool recv_msg(sockfd_t sockfd, std::vector<uint8_t> & input) {
     return recv_data(sockfd, input.data(), size);
 }
 
+// 64-bit FNV-1a, hash can be the result of a previous call to hash several buffers
+static uint64_t fnv_hash(const uint8_t * data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
 static bool parse_endpoint(const std::string & endpoint, std::string & host, int & port) {
     size_t pos = endpoint.find(':');
     if (pos == std::string::npos) {
@@ -438,6 +479,8 @@ static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t buffer) {
 
 static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
     rpc_tensor result;
+    // zero the padding and the end of the name, so that equal tensors serialize to the same bytes
+    memset(&result, 0, sizeof(result));
     result.id = reinterpret_cast<uint64_t>(tensor);
     result.type = tensor->type;
     if (tensor->buffer) {
@@ -476,10 +519,25 @@ static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t buffer, gg
 
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    if (size > HASH_THRESHOLD) {
+        // check if the server already has the data in its cache
+        rpc_msg_set_tensor_hash_req request;
+        request.tensor = rpc_tensor;
+        request.offset = offset;
+        request.size = size;
+        request.hash = fnv_hash((const uint8_t *)data, size);
+        rpc_msg_set_tensor_hash_rsp response;
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_HASH, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.result) {
+            // the server has the same data, no need to send it
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
-    rpc_tensor rpc_tensor = serialize_tensor(tensor);
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
@@ -656,14 +714,70 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
+static uint64_t graph_hash_tensor(const ggml_tensor * tensor, uint64_t hash) {
+    for (; tensor != nullptr; tensor = tensor->view_src) {
+        const rpc_tensor serialized = serialize_tensor(tensor);
+        hash = fnv_hash((const uint8_t *) &serialized, sizeof(serialized), hash);
+    }
+    return hash;
+}
+
+// hash of the tensors sent by serialize_graph, computed without serializing the graph:
+// each node is hashed along with its sources, which covers the leafs of the graph
+static uint64_t graph_hash(const ggml_cgraph * cgraph) {
+    uint64_t hash = fnv_hash((const uint8_t *) &cgraph->n_nodes, sizeof(cgraph->n_nodes));
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        hash = graph_hash_tensor(node, hash);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            hash = graph_hash_tensor(node->src[j], hash);
+        }
+    }
+    return hash;
+}
+
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
-    std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
-    GGML_ASSERT(status);
+
+    // the graphs already sent are computed by id, the others are sent along with their id in the same command
+    // input serialization format: | graph_id (8 bytes) | graph (see serialize_graph, only if not cached) |
+    const uint64_t hash = graph_hash(cgraph);
+    auto it = sock->graph_ids.find(hash);
+    uint64_t graph_id = it != sock->graph_ids.end() ? it->second : 0;
+
+    std::vector<uint8_t> input;
+    rpc_msg_graph_compute_cached_rsp response;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (graph_id == 0) {
+            graph_id = sock->next_graph_id++;
+            if (sock->graph_hashes.size() >= MAX_CACHED_GRAPHS) {
+                // the server evicts its oldest graph as well
+                sock->graph_ids.erase(sock->graph_hashes.front());
+                sock->graph_hashes.pop_front();
+            }
+            sock->graph_ids[hash] = graph_id;
+            sock->graph_hashes.push_back(hash);
+
+            serialize_graph(cgraph, input);
+            input.insert(input.begin(), (const uint8_t *) &graph_id, (const uint8_t *) &graph_id + sizeof(graph_id));
+        } else {
+            input.resize(sizeof(graph_id));
+            memcpy(input.data(), &graph_id, sizeof(graph_id));
+        }
+        bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE_CACHED, input.data(), input.size(), &response, sizeof(response));
+        GGML_ASSERT(status);
+        if (response.found) {
+            break;
+        }
+        // the server does not have the graph, which is only possible if a graph was evicted out of order:
+        // forget the cache and send the graph again
+        GGML_ASSERT(input.size() == sizeof(graph_id));
+        sock->graph_ids.clear();
+        sock->graph_hashes.clear();
+        graph_id = 0;
+    }
+    GGML_ASSERT(response.found);
     return (enum ggml_status)response.result;
 }
 
@@ -721,8 +835,8 @@ GGML_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * en
 
 ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
     ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context {
-        /* .endpoint  = */ endpoint,
-        /* .name      = */ "RPC[" + std::string(endpoint) + "]",
+        /* .endpoint = */ endpoint,
+        /* .name     = */ "RPC[" + std::string(endpoint) + "]",
     };
 
     ggml_backend_t backend = new ggml_backend {
@@ -760,7 +874,9 @@ GGML_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t *
 
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(ggml_backend_t backend, const char * cache_dir)
+        : backend(backend), cache_dir(cache_dir) {
+    }
     ~rpc_server();
 
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
@@ -770,9 +886,11 @@ public:
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    bool graph_compute_cached(const std::vector<uint8_t> & input, rpc_msg_graph_compute_cached_rsp & response);
 
 private:
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
@@ -780,10 +898,23 @@ private:
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
-
+    std::string get_cache_file(uint64_t hash) const;
+    bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
+    ggml_cgraph * deserialize_graph(const uint8_t * data, size_t size, struct ggml_context ** ctx_out);
+    bool graph_register(uint64_t graph_id, const uint8_t * data, size_t size);
+    void clear_graphs();
+
+    struct cached_graph {
+        struct ggml_context * ctx;
+        struct ggml_cgraph  * graph;
+    };
 
     ggml_backend_t backend;
+    const char * cache_dir;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    // graphs registered by the client, in order of registration
+    std::unordered_map<uint64_t, cached_graph> graphs;
+    std::deque<uint64_t> graph_ids;
 };
 
 void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response) {
@@ -834,6 +965,8 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
         GGML_PRINT_DEBUG("[%s] buffer not found\n", __func__);
         return false;
     }
+    // registered graphs may reference tensors in this buffer
+    clear_graphs();
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
     return true;
@@ -916,11 +1049,114 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     }
 
     const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    if (cache_dir && size > HASH_THRESHOLD) {
+        // save to cache_dir/hash
+        // the data is written to a temporary file that is renamed when complete, so that an interrupted write does
+        // not leave a truncated file under the final name
+        std::string cache_file = get_cache_file(fnv_hash((const uint8_t *)data, size));
+        std::string tmp_file = cache_file + ".tmp";
+        bool cached = false;
+        FILE * f = fopen(cache_file.c_str(), "rb");
+        const bool exists = f != NULL;
+        if (f) {
+            // a file of another size is left from an older version or holds other data with the same hash
+            cached = fseek(f, 0, SEEK_END) == 0 && ftell(f) == (long) size;
+            fclose(f);
+        }
+        if (!cached && (f = fopen(tmp_file.c_str(), "wb")) != NULL) {
+            bool ok = fwrite(data, 1, size, f) == size;
+            ok = fclose(f) == 0 && ok;
+            if (ok && exists) {
+                // rename() does not replace an existing file on all platforms
+                remove(cache_file.c_str());
+            }
+            ok = ok && rename(tmp_file.c_str(), cache_file.c_str()) == 0;
+            if (ok) {
+                printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
+            } else {
+                fprintf(stderr, "Failed to write cache file '%s'\n", cache_file.c_str());
+                remove(tmp_file.c_str());
+            }
+        }
+    }
     ggml_backend_tensor_set(tensor, data, offset, size);
     ggml_free(ctx);
     return true;
 }
 
+std::string rpc_server::get_cache_file(uint64_t hash) const {
+    char hash_str[17];
+    snprintf(hash_str, sizeof(hash_str), "%016" PRIx64, hash);
+    std::string path = cache_dir;
+    if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+        path += '/';
+    }
+    return path + hash_str;
+}
+
+bool rpc_server::get_cached_file(uint64_t hash, std::vector<uint8_t> & data) {
+    if (!cache_dir) {
+        return false;
+    }
+    std::string cache_file = get_cache_file(hash);
+    FILE * f = fopen(cache_file.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fseek(f, 0, SEEK_END) == 0;
+    long size = ok ? ftell(f) : -1;
+    ok = ok && size >= 0 && fseek(f, 0, SEEK_SET) == 0;
+    if (ok) {
+        data.resize(size);
+        ok = fread(data.data(), 1, size, f) == (size_t) size;
+    }
+    fclose(f);
+    return ok;
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    std::vector<uint8_t> cached_file;
+    if (!get_cached_file(request.hash, cached_file)) {
+        response.result = 0;
+        return true;
+    }
+    // a file of another size holds other data with the same hash - the client sends the data instead
+    if (cached_file.size() != request.size) {
+        response.result = 0;
+        return true;
+    }
+    size_t size = cached_file.size();
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_PRINT_DEBUG("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu, hash: %" PRIx64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, size, request.hash);
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0
+         || request.tensor.data + request.offset >= p1
+         || size > (p1 - request.tensor.data - request.offset)) {
+            GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+    ggml_backend_tensor_set(tensor, cached_file.data(), request.offset, size);
+    response.result = 1;
+    ggml_free(ctx);
+    return true;
+}
+
 bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -998,24 +1234,24 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+ggml_cgraph * rpc_server::deserialize_graph(const uint8_t * data, size_t size, struct ggml_context ** ctx_out) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
-    if (input.size() < sizeof(uint32_t)) {
-        return false;
+    if (size < sizeof(uint32_t)) {
+        return nullptr;
     }
     uint32_t n_nodes;
-    memcpy(&n_nodes, input.data(), sizeof(n_nodes));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
-        return false;
+    memcpy(&n_nodes, data, sizeof(n_nodes));
+    if (size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
+        return nullptr;
     }
-    const uint64_t * nodes = (const uint64_t *)(input.data() + sizeof(n_nodes));
+    const uint64_t * nodes = (const uint64_t *)(data + sizeof(n_nodes));
     uint32_t n_tensors;
-    memcpy(&n_tensors, input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
-        return false;
+    memcpy(&n_tensors, data + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    if (size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
+        return nullptr;
     }
-    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+    const rpc_tensor * tensors = (const rpc_tensor *)(data + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
     GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u\n", __func__, n_nodes, n_tensors);
 
     size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
@@ -1037,20 +1273,89 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
         memcpy(&id, &nodes[i], sizeof(id));
         graph->nodes[i] = create_node(id, ctx, tensor_ptrs, tensor_map);
     }
+    *ctx_out = ctx;
+    return graph;
+}
+
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph * graph = deserialize_graph(input.data(), input.size(), &ctx);
+    if (graph == nullptr) {
+        return false;
+    }
     ggml_status status = ggml_backend_graph_compute(backend, graph);
     response.result = status;
     ggml_free(ctx);
     return true;
 }
 
+bool rpc_server::graph_register(uint64_t graph_id, const uint8_t * data, size_t size) {
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph * graph = deserialize_graph(data, size, &ctx);
+    if (graph == nullptr) {
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] graph_id: %" PRIu64 "\n", __func__, graph_id);
+    auto it = graphs.find(graph_id);
+    if (it != graphs.end()) {
+        ggml_free(it->second.ctx);
+        it->second = {ctx, graph};
+        return true;
+    }
+    if (graph_ids.size() >= MAX_CACHED_GRAPHS) {
+        // evict the oldest graph
+        uint64_t oldest = graph_ids.front();
+        graph_ids.pop_front();
+        ggml_free(graphs[oldest].ctx);
+        graphs.erase(oldest);
+    }
+    graphs[graph_id] = {ctx, graph};
+    graph_ids.push_back(graph_id);
+    return true;
+}
+
+bool rpc_server::graph_compute_cached(const std::vector<uint8_t> & input, rpc_msg_graph_compute_cached_rsp & response) {
+    // serialization format: | graph_id (8 bytes) | graph (see deserialize_graph, only if not cached) |
+    if (input.size() < sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t graph_id;
+    memcpy(&graph_id, input.data(), sizeof(graph_id));
+    if (input.size() > sizeof(graph_id)) {
+        if (!graph_register(graph_id, input.data() + sizeof(graph_id), input.size() - sizeof(graph_id))) {
+            return false;
+        }
+    }
+    auto it = graphs.find(graph_id);
+    if (it == graphs.end()) {
+        GGML_PRINT_DEBUG("[%s] graph_id %" PRIu64 " not found\n", __func__, graph_id);
+        response.found = 0;
+        response.result = GGML_STATUS_FAILED;
+        return true;
+    }
+    response.found = 1;
+    response.result = ggml_backend_graph_compute(backend, it->second.graph);
+    return true;
+}
+
+void rpc_server::clear_graphs() {
+    for (auto & it : graphs) {
+        ggml_free(it.second.ctx);
+    }
+    graphs.clear();
+    graph_ids.clear();
+}
+
 rpc_server::~rpc_server() {
+    clear_graphs();
     for (auto buffer : buffers) {
         ggml_backend_buffer_free(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
+                             sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir);
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1149,6 +1454,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_SET_TENSOR_HASH: {
+                rpc_msg_set_tensor_hash_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_set_tensor_hash_rsp response;
+                if (!server.set_tensor_hash(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_TENSOR: {
                 rpc_msg_get_tensor_req request;
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1191,6 +1510,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
                 }
                 break;
             }
+            case RPC_CMD_GRAPH_COMPUTE_CACHED: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                rpc_msg_graph_compute_cached_rsp response;
+                if (!server.graph_compute_cached(input, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_DEVICE_MEMORY: {
                 if (!recv_msg(sockfd, nullptr, 0)) {
                     return;
@@ -1211,7 +1544,9 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint,
+                                   const char * cache_dir,
+                                   size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1240,7 +1575,7 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
         printf("Client connection closed\n");
         fflush(stdout);
     }
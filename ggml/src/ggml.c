@@ -13003,6 +13003,9 @@ static void ggml_compute_forward_out_prod_f32(
     }
 }
 
+// number of src0 rows that are dequantized at once and reused for all dst rows of a thread
+#define GGML_OUT_PROD_Q_ROWS 16
+
 static void ggml_compute_forward_out_prod_q_f32(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -13018,8 +13021,8 @@ static void ggml_compute_forward_out_prod_q_f32(
     const enum ggml_type type = src0->type;
     ggml_to_float_t const dequantize_row_q = type_traits[type].to_float;
 
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne12 % ne02 == 0);
+    GGML_ASSERT(ne13 % ne03 == 0);
     GGML_ASSERT(ne2  == ne12);
     GGML_ASSERT(ne3  == ne13);
 
@@ -13034,8 +13037,6 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     GGML_ASSERT(ne0 == ne00);
     GGML_ASSERT(ne1 == ne10);
-    GGML_ASSERT(ne2 == ne02);
-    GGML_ASSERT(ne3 == ne03);
 
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
@@ -13057,38 +13058,58 @@ static void ggml_compute_forward_out_prod_q_f32(
     const int64_t ir0 = dr*ith;
     const int64_t ir1 = MIN(ir0 + dr, nr);
 
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
     // dst[:,:,:,:] = 0
     // for i2,i3:
     //   for i1:
     //     for i01:
     //       for i0:
-    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
+    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2/r2,i3/r3] * src1[i1,i01,i2,i3]
+    //
+    // src0 rows are dequantized in blocks of GGML_OUT_PROD_Q_ROWS and reused for all dst rows of the thread that
+    // broadcast the same src0 matrix, i.e. the r2 heads that share a kv head with GQA
 
-    float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
+    float * wdata = (float *) params->wdata + (GGML_OUT_PROD_Q_ROWS*ne0 + CACHE_LINE_SIZE_F32) * ith;
 
-    for (int64_t ir = ir0; ir < ir1; ++ir) {
-        // dst indices
+    for (int64_t ir = ir0; ir < ir1; ) {
+        // dst indices of the first row
         const int64_t i3 = ir/(ne2*ne1);
         const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
-        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+        const int64_t i02 = i2/r2;
+        const int64_t i03 = i3/r3;
+
+        // dst rows [ir, ir_end) of this thread use the same src0 matrix
+        const int64_t ir_end = MIN(ir1, i3*ne2*ne1 + MIN(ne2, (i02 + 1)*r2)*ne1);
+
+        for (int64_t i01_0 = 0; i01_0 < ne01; i01_0 += GGML_OUT_PROD_Q_ROWS) {
+            const int64_t n01 = MIN(GGML_OUT_PROD_Q_ROWS, ne01 - i01_0);
+
+            for (int64_t j = 0; j < n01; ++j) {
+                const void * s0 = (const char *) src0->data + ((i01_0 + j)*nb01 + i02*nb02 + i03*nb03);
+                dequantize_row_q(s0, wdata + j*ne0, ne0);
+            }
+
+            for (int64_t jr = ir; jr < ir_end; ++jr) {
+                const int64_t j2 = (jr - i3*ne2*ne1)/ne1;
+                const int64_t j1 = (jr - i3*ne2*ne1 - j2*ne1);
 
-        //const int64_t i10 = i1;
-        const int64_t i12 = i2;
-        const int64_t i13 = i3;
+                float * d = (float *) ((char *) dst->data + (j1*nb1 + j2*nb2 + i3*nb3));
 
-        for (int64_t i01 = 0; i01 < ne01; ++i01) {
-            const int64_t i11 = i01;
+                for (int64_t j = 0; j < n01; ++j) {
+                    const int64_t i11 = i01_0 + j;
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+                    const float * s1 = (const float *) ((const char *) src1->data + (j1*nb10 + i11*nb11 + j2*nb12 + i3*nb13));
 
-            dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+                    ggml_vec_mad_f32(ne0, d, wdata + j*ne0, *s1);
+                }
+            }
         }
+
+        ir = ir_end;
     }
 }
 
@@ -19785,7 +19806,7 @@ struct ggml_cplan ggml_graph_plan(
             case GGML_OP_OUT_PROD:
                 {
                     if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                        cur = ggml_type_size(GGML_TYPE_F32) * (GGML_OUT_PROD_Q_ROWS*node->src[0]->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
                     }
                 } break;
             case GGML_OP_SOFT_MAX:
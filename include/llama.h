@@ -39,12 +39,16 @@
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGSC 0x67677363u // 'ggsc'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
+
+#define LLAMA_STATE_SEQ_COMPRESSED_MAGIC   LLAMA_FILE_MAGIC_GGSC
+#define LLAMA_STATE_SEQ_COMPRESSED_VERSION 1
 
 #ifdef __cplusplus
 extern "C" {
@@ -302,6 +306,11 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_direct_io; // read tensor data with O_DIRECT when not using mmap, bypassing the page cache (Linux only)
+
+        // stream memory mapped weights for models larger than RAM: while a layer is evaluated, the next
+        // n_prefetch_layers layers are prefetched and the layers already evaluated are released (0 = disabled)
+        int32_t n_prefetch_layers;
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -752,6 +761,68 @@ extern "C" {
                           size_t   size,
                     llama_seq_id   dest_seq_id);
 
+    // Incremental snapshots of a single sequence
+    // A delta holds only the cells of the sequence at positions [p0, inf), where p0 is the watermark of the previous
+    // snapshot (e.g. llama_kv_cache_seq_pos_max() + 1 at the time it was taken), so its cost is O(new tokens)
+    // For recurrent models, the delta is a full snapshot
+
+    // Get the exact size needed to copy the delta of a single sequence
+    LLAMA_API size_t llama_state_seq_get_size_delta(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    // Copy the cells of a single sequence at positions [p0, inf) into the specified buffer
+    LLAMA_API size_t llama_state_seq_get_data_delta(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0);
+
+    // Apply a delta (originally copied with `llama_state_seq_get_data_delta`) on top of the specified sequence
+    // The cells of the sequence from the first position of the delta on are replaced, the ones before it are kept
+    // A sequence is restored by `llama_state_seq_set_data` of the base snapshot followed by its deltas, in order
+    // Returns:
+    //  - Positive: Ok
+    //  - Zero: Failed to load, the sequence is cleared
+    LLAMA_API size_t llama_state_seq_set_data_delta(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
+    // Compact form of the state of a single sequence, for moving it to another context or host
+    // The K/V rows are quantized to Q8_0 (unless they are already as small) and the cell positions are delta encoded
+    // The loader converts the rows to the types and V layout of the destination context, so the source and destination
+    // may use different cache types and flash attention settings
+    // The state is lossy for F16/F32 caches and does not hold the seq_id of the cells shared with other sequences
+    // The state starts with a magic, a version and the row sizes of each layer; a state of another model is rejected
+    #define LLAMA_STATE_SEQ_FLAGS_COMPRESS 1
+
+    typedef uint32_t llama_state_seq_flags;
+
+    // flags == 0 is the same as the functions without the _ext suffix
+    LLAMA_API size_t llama_state_seq_get_size_ext(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    LLAMA_API size_t llama_state_seq_get_data_ext(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+           llama_state_seq_flags   flags);
+
+    // the flags must match the ones the state was copied with
+    LLAMA_API size_t llama_state_seq_set_data_ext(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id,
+           llama_state_seq_flags   flags);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -935,6 +1006,25 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert multiple texts into tokens using up to n_threads threads.
+    ///          Long texts are also split at safe pre-tokenizer boundaries and tokenized in parallel.
+    /// @param texts, text_lens The n_texts input texts.
+    /// @param tokens The tokens of all texts are written back to back. Must be large enough to hold the resulting tokens.
+    /// @param n_tokens Receives the number of tokens of each text, also on failure (n_texts elements).
+    /// @return Returns the total number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the total number of tokens that would have been returned
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_model * model,
+               const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1037,6 +1127,10 @@ extern "C" {
         struct llama_sampler * (*clone) (const struct llama_sampler * smpl);                                 // can be NULL if ctx is NULL
         void                   (*free)  (      struct llama_sampler * smpl);                                 // can be NULL if ctx is NULL
 
+        // writes the tokens that can be selected after applying the sampler to the whole vocab to a token mask
+        // returns false if the sampler does not restrict the tokens to a fixed set
+        bool (*get_mask)(const struct llama_sampler * smpl, uint32_t * mask, int32_t n_vocab); // can be NULL
+
         // TODO: API for internal libllama usage for appending the sampling to an existing ggml_cgraph
         //void (*apply_ggml) (struct llama_sampler * smpl, ...);
     };
@@ -1054,6 +1148,24 @@ extern "C" {
     LLAMA_API struct llama_sampler * llama_sampler_clone (const struct llama_sampler * smpl);
     // important: do not free if the sampler has been added to a llama_sampler_chain (via llama_sampler_chain_add)
     LLAMA_API void                   llama_sampler_free  (      struct llama_sampler * smpl);
+    LLAMA_API bool                   llama_sampler_get_mask(const struct llama_sampler * smpl, uint32_t * mask, int32_t n_vocab);
+
+    // token masks
+    // a packed set of tokens: token id is in the set if bit (id % 32) of mask[id / 32] is set
+    // the mask of a vocab with n_vocab tokens has LLAMA_TOKEN_MASK_SIZE(n_vocab) words
+    //
+    // the mask of a constraint such as the grammar sampler can be applied to the logits before the candidates are
+    // built, so that the other samplers only see the allowed tokens:
+    //
+    //    std::vector<uint32_t> mask(LLAMA_TOKEN_MASK_SIZE(n_vocab));
+    //    if (llama_sampler_get_mask(grmr, mask.data(), n_vocab)) {
+    //        llama_token_mask_apply(logits, mask.data(), n_vocab);
+    //    }
+    //
+#define LLAMA_TOKEN_MASK_SIZE(n_vocab) (((n_vocab) + 31)/32)
+
+    // sets the logits of the tokens that are not in the mask to -INFINITY
+    LLAMA_API void llama_token_mask_apply(float * logits, const uint32_t * mask, int32_t n_vocab);
 
     // llama_sampler_chain
     // a type of llama_sampler that can chain multiple samplers one after another
@@ -1184,6 +1296,24 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Build the candidates from the raw logits, keeping only the tokens that can survive a top-k (if top_k > 0)
+    ///          followed by a min-p (if min_p > 0, with at least min_keep tokens) truncation
+    ///          The threshold is guessed from a sample of the logits (top-k) or from their max (min-p) and refined on
+    ///          the tokens above it, so the whole vocab is neither sorted nor copied. The tokens in keep, e.g. those
+    ///          that the samplers before the truncation can change, are always included and the thresholds are
+    ///          computed as if they were not there.
+    ///          data must have room for n_vocab candidates, which are written in the order of their ids.
+    // Returns the number of candidates
+    LLAMA_API size_t llama_logits_get_candidates(
+                   const float * logits,
+                       int32_t   n_vocab,
+                       int32_t   top_k,
+                         float   min_p,
+                        size_t   min_keep,
+             const llama_token * keep,
+                        size_t   n_keep,
+        struct llama_token_data * data);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
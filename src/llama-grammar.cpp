@@ -5,6 +5,10 @@
 
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 
 //
@@ -28,14 +32,15 @@ static std::pair<uint32_t, const char *> decode_utf8(const char * src) {
 }
 
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        const char * src,
+        size_t size,
         llama_partial_utf8 partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src;
     std::vector<uint32_t> code_points;
 
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
-    code_points.reserve(src.size() + 1);
+    code_points.reserve(size + 1);
     uint32_t value    = partial_start.value;
     int      n_remain = partial_start.n_remain;
 
@@ -682,37 +687,66 @@ static bool llama_grammar_match_partial_char(
     return !is_positive_char;
 }
 
-// transforms a grammar pushdown stack into N possible stacks, all ending
-// at a character range (terminal element)
-static void llama_grammar_advance_stack(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stack  & stack,
-              llama_grammar_stacks & new_stacks) {
-    if (stack.empty()) {
-        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-            new_stacks.emplace_back(stack);
-        }
-        return;
+static void llama_grammar_add_stack(llama_grammar_stacks & stacks, llama_grammar_stack && stack) {
+    // only add the stack if it's not a duplicate of one we already have
+    if (std::find(stacks.begin(), stacks.end(), stack) == stacks.end()) {
+        stacks.emplace_back(std::move(stack));
     }
+}
 
-    const llama_grammar_element * pos = stack.back();
+// the stacks that the stack holding only pos advances to (see llama_grammar_advance_stack), memoized per element
+// an empty stack in the result means that pos can derive the empty string, in which case the stack below pos has
+// to be advanced too
+static const llama_grammar_stacks & llama_grammar_advance_element(
+        const llama_grammar_rules         & rules,
+        const llama_grammar_element       * pos,
+              llama_grammar_advance_cache & cache) {
+    auto it = cache.find(pos);
+    if (it != cache.end()) {
+        return it->second;
+    }
+
+    llama_grammar_stacks result;
 
     switch (pos->type) {
         case LLAMA_GRETYPE_RULE_REF: {
             const size_t                  rule_id = static_cast<size_t>(pos->value);
             const llama_grammar_element * subpos  = rules[rule_id].data();
+
             do {
-                // init new stack without the top (pos)
-                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
-                if (!llama_grammar_is_end_of_sequence(pos + 1)) {
-                    // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
-                }
+                llama_grammar_stacks alt;
                 if (!llama_grammar_is_end_of_sequence(subpos)) {
-                    // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
+                    alt = llama_grammar_advance_element(rules, subpos, cache);
+                } else {
+                    alt.emplace_back();
                 }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+
+                for (const auto & stack : alt) {
+                    if (stack.empty()) {
+                        // the alternate can be empty, continue with the element after the rule ref
+                        // note: this is expanded only when needed, as the element may refer back to this rule
+                        if (llama_grammar_is_end_of_sequence(pos + 1)) {
+                            llama_grammar_add_stack(result, llama_grammar_stack());
+                        } else {
+                            const llama_grammar_stacks after = llama_grammar_advance_element(rules, pos + 1, cache);
+                            for (const auto & stack_after : after) {
+                                llama_grammar_add_stack(result, llama_grammar_stack(stack_after));
+                            }
+                        }
+                        continue;
+                    }
+
+                    // the element after the rule ref (if any) goes below the stack of the alternate
+                    llama_grammar_stack new_stack;
+                    new_stack.reserve(stack.size() + 1);
+                    if (!llama_grammar_is_end_of_sequence(pos + 1)) {
+                        new_stack.push_back(pos + 1);
+                    }
+                    new_stack.insert(new_stack.end(), stack.begin(), stack.end());
+
+                    llama_grammar_add_stack(result, std::move(new_stack));
+                }
+
                 while (!llama_grammar_is_end_of_sequence(subpos)) {
                     // scan to end of alternate def
                     subpos++;
@@ -729,10 +763,7 @@ static void llama_grammar_advance_stack(
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
         case LLAMA_GRETYPE_CHAR_ANY:
-            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-                // only add the stack if it's not a duplicate of one we already have
-                new_stacks.emplace_back(stack);
-            }
+            result.push_back({ pos });
             break;
         default:
             // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
@@ -740,22 +771,56 @@ static void llama_grammar_advance_stack(
             // those
             GGML_ABORT("fatal error");
     }
+
+    return cache.emplace(pos, std::move(result)).first->second;
+}
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+// only the top of the stack is expanded, so the expansions of each element are computed once and then reused
+static void llama_grammar_advance_stack(
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stack         & stack,
+              llama_grammar_stacks        & new_stacks,
+              llama_grammar_advance_cache & cache) {
+    if (stack.empty()) {
+        llama_grammar_add_stack(new_stacks, llama_grammar_stack());
+        return;
+    }
+
+    const llama_grammar_stacks & tops = llama_grammar_advance_element(rules, stack.back(), cache);
+
+    for (const auto & top : tops) {
+        if (top.empty()) {
+            // the top element can be empty, continue with the elements below it
+            llama_grammar_advance_stack(rules, llama_grammar_stack(stack.begin(), stack.end() - 1), new_stacks, cache);
+            continue;
+        }
+
+        llama_grammar_stack new_stack;
+        new_stack.reserve(stack.size() - 1 + top.size());
+        new_stack.insert(new_stack.end(), stack.begin(), stack.end() - 1);
+        new_stack.insert(new_stack.end(), top.begin(), top.end());
+
+        llama_grammar_add_stack(new_stacks, std::move(new_stack));
+    }
 }
 
 static llama_grammar_candidates llama_grammar_reject_candidates(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stacks     & stacks,
-        const llama_grammar_candidates & candidates) {
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stacks        & stacks,
+        const llama_grammar_candidates    & candidates,
+              llama_grammar_advance_cache & cache) {
     GGML_ASSERT(!stacks.empty()); // REVIEW
 
     if (candidates.empty()) {
         return {};
     }
 
-    auto rejects = llama_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    auto rejects = llama_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates, &cache);
 
     for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = llama_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+        rejects = llama_grammar_reject_candidates_for_stack(rules, stacks[i], rejects, &cache);
     }
 
     return rejects;
@@ -823,10 +888,16 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
 }
 
 void llama_grammar_accept(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stacks & stacks,
-        const uint32_t               chr,
-              llama_grammar_stacks & stacks_new) {
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stacks        & stacks,
+        const uint32_t                      chr,
+              llama_grammar_stacks        & stacks_new,
+              llama_grammar_advance_cache * cache) {
+    llama_grammar_advance_cache cache_local;
+    if (cache == nullptr) {
+        cache = &cache_local;
+    }
+
     stacks_new.clear();
     stacks_new.reserve(stacks.size());
 
@@ -844,15 +915,20 @@ void llama_grammar_accept(
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new, *cache);
         }
     }
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stack      & stack,
-        const llama_grammar_candidates & candidates) {
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stack         & stack,
+        const llama_grammar_candidates    & candidates,
+              llama_grammar_advance_cache * cache) {
+    llama_grammar_advance_cache cache_local;
+    if (cache == nullptr) {
+        cache = &cache_local;
+    }
 
     llama_grammar_candidates rejects;
     rejects.reserve(candidates.size());
@@ -894,9 +970,9 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
         stack_after.push_back(stack_pos_after);
     }
     llama_grammar_stacks next_stacks;
-    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+    llama_grammar_advance_stack(rules, stack_after, next_stacks, *cache);
 
-    auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates, *cache);
     for (const auto & tok : next_rejects) {
         rejects.push_back({ tok.index, tok.code_points - 1, tok.partial_utf8 });
     }
@@ -937,6 +1013,7 @@ struct llama_grammar * llama_grammar_init_impl(
     }
 
     // loop over alternates of start rule to build initial stacks
+    llama_grammar_advance_cache cache;
     llama_grammar_stacks stacks;
     pos = vec_rules[start_rule_index].data();
     do {
@@ -945,7 +1022,7 @@ struct llama_grammar * llama_grammar_init_impl(
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(vec_rules, stack, stacks, cache);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -961,7 +1038,8 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    // the cache is moved along with vec_rules, for the same reason
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, nullptr, std::move(cache), };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1015,6 +1093,7 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     }
 
     // loop over alternates of start rule to build initial stacks
+    llama_grammar_advance_cache cache;
     llama_grammar_stacks stacks;
     pos = vec_rules[start_rule_index].data();
     do {
@@ -1023,7 +1102,7 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(vec_rules, stack, stacks, cache);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -1039,7 +1118,8 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    // the cache is moved along with vec_rules, for the same reason
+    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, nullptr, std::move(cache), };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1053,14 +1133,17 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
     llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, };
 
+    const std::less<const llama_grammar_element *> less;
+
     // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
-                    }
+    for (auto & stack : result->stacks) {
+        for (auto & elem : stack) {
+            for (size_t ir = 0; ir < grammar.rules.size(); ir++) {
+                const llama_grammar_element * begin = grammar.rules[ir].data();
+                const llama_grammar_element * end   = begin + grammar.rules[ir].size();
+                if (!less(elem, begin) && less(elem, end)) {
+                    elem = result->rules[ir].data() + (elem - begin);
+                    break;
                 }
             }
         }
@@ -1069,6 +1152,323 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     return result;
 }
 
+// builds the subtree of trie[inode] from the candidates [begin, end), which share their first depth code points
+static void llama_grammar_build_trie(
+        std::vector<llama_grammar_trie_node> & trie,
+        const llama_grammar_candidates       & candidates,
+        uint32_t inode,
+        uint32_t begin,
+        uint32_t end,
+        size_t   depth) {
+    uint32_t i = begin;
+    while (i < end && candidates[i].code_points[depth] == 0) {
+        ++i;
+    }
+
+    trie[inode].tok_begin = begin;
+    trie[inode].tok_end   = i;
+
+    // one child per distinct code point, the range of candidates is kept in tok_begin/tok_end until the child is built
+    const uint32_t child_begin = trie.size();
+    while (i < end) {
+        const uint32_t chr = candidates[i].code_points[depth];
+
+        uint32_t j = i;
+        while (j < end && candidates[j].code_points[depth] == chr) {
+            ++j;
+        }
+
+        trie.push_back({ chr, 0, 0, i, j });
+        i = j;
+    }
+    const uint32_t child_end = trie.size();
+
+    trie[inode].child_begin = child_begin;
+    trie[inode].child_end   = child_end;
+
+    for (uint32_t ic = child_begin; ic < child_end; ++ic) {
+        llama_grammar_build_trie(trie, candidates, ic, trie[ic].tok_begin, trie[ic].tok_end, depth + 1);
+    }
+}
+
+// state of a walk of the trie, each distinct stack is advanced at most once per walk
+struct llama_grammar_trie_walk {
+    const llama_grammar_rules      & rules;
+    const llama_grammar_vocab_trie & vocab_trie;
+
+    llama_grammar_advance_cache & advance_cache;
+
+    std::vector<uint32_t> & mask;
+
+    std::map<llama_grammar_stack, uint32_t> ids;
+    std::vector<llama_grammar_stack>        stacks;
+
+    // after[id] are the ids of the stacks after matching a char with the top of stacks[id], any char will do
+    // note: deque so that the references passed down the walk stay valid
+    std::deque<std::vector<uint32_t>> after;
+    std::vector<bool>                 after_done;
+
+    uint32_t get_id(const llama_grammar_stack & stack) {
+        auto it = ids.find(stack);
+        if (it != ids.end()) {
+            return it->second;
+        }
+
+        const uint32_t id = stacks.size();
+        ids.emplace(stack, id);
+        stacks.push_back(stack);
+        after.emplace_back();
+        after_done.push_back(false);
+
+        return id;
+    }
+
+    const std::vector<uint32_t> & get_after(uint32_t id, const llama_grammar_element * pos_after) {
+        if (!after_done[id]) {
+            llama_grammar_stack stack_after(stacks[id].begin(), stacks[id].end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos_after)) {
+                stack_after.push_back(pos_after);
+            }
+
+            llama_grammar_stacks stacks_new;
+            llama_grammar_advance_stack(rules, stack_after, stacks_new, advance_cache);
+
+            std::vector<uint32_t> res;
+            for (const auto & stack : stacks_new) {
+                res.push_back(get_id(stack));
+            }
+
+            after[id]      = std::move(res);
+            after_done[id] = true;
+        }
+
+        return after[id];
+    }
+
+    // sets the bits of the candidates in the subtree of trie[inode] that are allowed by at least one of the stacks
+    // the children whose code point is not matched by any stack are skipped along with all the tokens below them
+    void walk(uint32_t inode, const std::vector<uint32_t> & ids_cur) {
+        const llama_grammar_trie_node & node = vocab_trie.trie[inode];
+
+        // the tokens that end here have matched all their code points, those ending in a partial sequence also
+        // need a stack that the sequence could complete
+        for (uint32_t i = node.tok_begin; i < node.tok_end; ++i) {
+            const llama_grammar_candidate & tok = vocab_trie.candidates[i];
+
+            bool allowed = tok.partial_utf8.n_remain == 0;
+            for (size_t j = 0; !allowed && j < ids_cur.size(); ++j) {
+                const llama_grammar_stack & stack = stacks[ids_cur[j]];
+                allowed = !stack.empty() && llama_grammar_match_partial_char(stack.back(), tok.partial_utf8);
+            }
+
+            if (allowed) {
+                mask[tok.index / 32] |= 1u << (tok.index % 32);
+            }
+        }
+
+        for (uint32_t ic = node.child_begin; ic < node.child_end; ++ic) {
+            const uint32_t chr = vocab_trie.trie[ic].chr;
+
+            const std::vector<uint32_t> * ids_next = nullptr;
+            std::vector<uint32_t> ids_union;
+
+            for (const uint32_t id : ids_cur) {
+                if (stacks[id].empty()) {
+                    continue;
+                }
+
+                const auto match = llama_grammar_match_char(stacks[id].back(), chr);
+                if (!match.first) {
+                    continue;
+                }
+
+                const std::vector<uint32_t> & ids_after = get_after(id, match.second);
+                if (ids_next == nullptr) {
+                    ids_next = &ids_after;
+                    continue;
+                }
+
+                // more than one stack matches the char
+                if (ids_next != &ids_union) {
+                    ids_union = *ids_next;
+                    ids_next  = &ids_union;
+                }
+                for (const uint32_t id_after : ids_after) {
+                    if (std::find(ids_union.begin(), ids_union.end(), id_after) == ids_union.end()) {
+                        ids_union.push_back(id_after);
+                    }
+                }
+            }
+
+            if (ids_next != nullptr) {
+                walk(ic, *ids_next);
+            }
+        }
+    }
+};
+
+// the decoded vocab and its trie are built by the first grammar that needs them and shared with the others
+static std::shared_ptr<const llama_grammar_vocab_trie> llama_grammar_get_vocab_trie(const llama_vocab & vocab) {
+    std::shared_ptr<const llama_grammar_vocab_trie> vocab_trie = std::atomic_load(&vocab.grammar_trie);
+    if (vocab_trie) {
+        return vocab_trie;
+    }
+
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    vocab_trie = std::atomic_load(&vocab.grammar_trie);
+    if (vocab_trie) {
+        return vocab_trie;
+    }
+
+    const uint32_t n_vocab = vocab.n_vocab;
+
+    auto res = std::make_shared<llama_grammar_vocab_trie>();
+
+    std::vector<llama_partial_utf8> partial(n_vocab);
+    std::vector<size_t>             offs(n_vocab);
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        size_t piece_size;
+        const char * piece = vocab.cache_get_piece(id, piece_size);
+
+        offs[id] = res->code_points.size();
+
+        if (llama_token_is_eog_impl(vocab, id) || piece[0] == 0) {
+            partial[id].n_remain = -1;
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, piece_size, {});
+        res->code_points.insert(res->code_points.end(), decoded.first.begin(), decoded.first.end());
+        partial[id] = decoded.second;
+    }
+
+    res->candidates.reserve(n_vocab);
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        if (partial[id].n_remain >= 0) {
+            res->candidates.push_back({ id, res->code_points.data() + offs[id], partial[id] });
+        }
+    }
+
+    // sort by code points so that the tokens below each node of the trie are contiguous
+    std::sort(res->candidates.begin(), res->candidates.end(),
+            [](const llama_grammar_candidate & a, const llama_grammar_candidate & b) {
+                const uint32_t * pa = a.code_points;
+                const uint32_t * pb = b.code_points;
+                while (*pa != 0 && *pa == *pb) {
+                    ++pa;
+                    ++pb;
+                }
+                return *pa < *pb;
+            });
+
+    res->trie.push_back({ 0, 0, 0, 0, 0 });
+    llama_grammar_build_trie(res->trie, res->candidates, 0, 0, res->candidates.size(), 0);
+
+    vocab_trie = res;
+    std::atomic_store(&vocab.grammar_trie, vocab_trie);
+
+    return vocab_trie;
+}
+
+// max number of stacks with a cached mask, each mask takes n_vocab/8 bytes
+#define LLAMA_GRAMMAR_MASK_CACHE_MAX 256
+
+// writes the union of the cached masks of the current stacks to allowed, EOG tokens are not included
+// returns false if the masks are not applicable, or if some are missing and can_compute is false
+static bool llama_grammar_get_mask_cached(const struct llama_grammar & grammar, uint32_t * allowed, bool can_compute) {
+    // the masks are for stacks at a code point boundary
+    if (grammar.partial_utf8.n_remain != 0) {
+        return false;
+    }
+
+    const llama_vocab & vocab = *grammar.vocab;
+
+    const uint32_t n_vocab = vocab.n_vocab;
+    const uint32_t n_words = (n_vocab + 31)/32;
+
+    auto & cache = grammar.mask_cache;
+
+    if (!cache) {
+        if (!can_compute) {
+            return false;
+        }
+
+        cache.reset(new llama_grammar_mask_cache);
+        cache->vocab_trie = llama_grammar_get_vocab_trie(vocab);
+    }
+
+    if (!can_compute) {
+        for (const auto & stack : grammar.stacks) {
+            if (!stack.empty() && cache->masks.find(stack) == cache->masks.end()) {
+                return false;
+            }
+        }
+    }
+
+    std::fill(allowed, allowed + n_words, 0);
+
+    for (const auto & stack : grammar.stacks) {
+        // the empty stack allows EOG only
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto it = cache->masks.find(stack);
+        if (it == cache->masks.end()) {
+            if (cache->masks.size() >= LLAMA_GRAMMAR_MASK_CACHE_MAX) {
+                cache->masks.clear();
+            }
+
+            std::vector<uint32_t> mask(n_words, 0);
+            llama_grammar_trie_walk walk { grammar.rules, *cache->vocab_trie, grammar.advance_cache, mask, {}, {}, {}, {} };
+            walk.walk(0, { walk.get_id(stack) });
+
+            it = cache->masks.emplace(stack, std::move(mask)).first;
+        }
+
+        const uint32_t * mask = it->second.data();
+        for (size_t i = 0; i < n_words; ++i) {
+            allowed[i] |= mask[i];
+        }
+    }
+
+    return true;
+}
+
+// applies the grammar using the cached masks of the current stacks
+// returns false if the masks are not applicable, or if computing the missing ones would cost more than rejecting the
+// candidates directly
+static bool llama_grammar_apply_cached(const struct llama_grammar & grammar, llama_token_data_array * cur_p, bool allow_eog) {
+    const llama_vocab & vocab = *grammar.vocab;
+
+    const uint32_t n_vocab = vocab.n_vocab;
+
+    // building the trie and computing a mask can visit the whole vocab
+    const bool can_compute = 2*cur_p->size >= n_vocab;
+
+    std::vector<uint32_t> allowed((n_vocab + 31)/32);
+    if (!llama_grammar_get_mask_cached(grammar, allowed.data(), can_compute)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const llama_token id = cur_p->data[i].id;
+
+        if (llama_token_is_eog_impl(vocab, id)) {
+            if (!allow_eog) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        } else if (!(allowed[id / 32] & (1u << (id % 32)))) {
+            cur_p->data[i].logit = -INFINITY;
+        }
+    }
+
+    return true;
+}
+
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
@@ -1080,6 +1480,10 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    if (llama_grammar_apply_cached(grammar, cur_p, allow_eog)) {
+        return;
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -1087,27 +1491,66 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
     candidates_grammar.reserve(cur_p->size);
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->cache_token_to_piece.at(id);
+        const llama_token id = cur_p->data[i].id;
+
+        size_t piece_size;
+        const char * piece = grammar.vocab->cache_get_piece(id, piece_size);
 
         if (llama_token_is_eog_impl(*grammar.vocab, id)) {
             if (!allow_eog) {
                 cur_p->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (piece[0] == 0) {
             cur_p->data[i].logit = -INFINITY;
         } else {
-            candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
+            candidates_decoded.push_back(decode_utf8(piece, piece_size, grammar.partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar, grammar.advance_cache);
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
 }
 
+void llama_grammar_get_mask_impl(const struct llama_grammar & grammar, uint32_t * mask) {
+    GGML_ASSERT(grammar.vocab != nullptr);
+
+    const llama_vocab & vocab = *grammar.vocab;
+
+    const uint32_t n_vocab = vocab.n_vocab;
+
+    if (!llama_grammar_get_mask_cached(grammar, mask, true)) {
+        // in the middle of a UTF-8 sequence - reject the tokens of the whole vocab directly
+        std::vector<llama_token_data> cur(n_vocab);
+        for (uint32_t id = 0; id < n_vocab; ++id) {
+            cur[id] = { (llama_token) id, 0.0f, 0.0f };
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_grammar_apply_impl(grammar, &cur_p);
+
+        std::fill(mask, mask + (n_vocab + 31)/32, 0);
+        for (uint32_t id = 0; id < n_vocab; ++id) {
+            if (cur[id].logit != -INFINITY) {
+                mask[id / 32] |= 1u << (id % 32);
+            }
+        }
+
+        return;
+    }
+
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            for (const llama_token id : vocab.special_eog_ids) {
+                mask[id / 32] |= 1u << (id % 32);
+            }
+            break;
+        }
+    }
+}
+
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
@@ -1120,16 +1563,17 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
         GGML_ABORT("fatal error");
     }
 
-    const std::string & piece = grammar.vocab->cache_token_to_piece.at(token);
+    size_t piece_size;
+    const char * piece = grammar.vocab->cache_get_piece(token, piece_size);
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(piece, grammar.partial_utf8);
+    const auto   decoded     = decode_utf8(piece, piece_size, grammar.partial_utf8);
     const auto & code_points = decoded.first;
 
     llama_grammar_stacks stacks_new;
 
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        llama_grammar_accept(grammar.rules, grammar.stacks, *it, stacks_new);
+        llama_grammar_accept(grammar.rules, grammar.stacks, *it, stacks_new, &grammar.advance_cache);
         grammar.stacks = std::move(stacks_new);
     }
 
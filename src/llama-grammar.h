@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 
 #include <map>
+#include <memory>
 
 struct llama_vocab;
 
@@ -58,6 +59,10 @@ using llama_grammar_rules      = std::vector<llama_grammar_rule>;
 using llama_grammar_stacks     = std::vector<llama_grammar_stack>;
 using llama_grammar_candidates = std::vector<llama_grammar_candidate>;
 
+// the stacks that a stack holding a single element advances to, per element
+// the expansion of a rule only depends on the top of the stack, so it is computed once per element and reused
+using llama_grammar_advance_cache = std::map<const llama_grammar_element *, llama_grammar_stacks>;
+
 const llama_grammar_rules  & llama_grammar_get_rules (const struct llama_grammar * grammar);
       llama_grammar_stacks & llama_grammar_get_stacks(      struct llama_grammar * grammar);
 
@@ -65,16 +70,19 @@ const llama_grammar_rules  & llama_grammar_get_rules (const struct llama_grammar
 // be positioned at a character range (see `llama_grammar_advance_stack`), and
 // produces the N possible stacks if the given char is accepted at those
 // positions
+// the cache must belong to the same rules, if null a temporary one is used
 void llama_grammar_accept(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stacks & stacks,
-                          uint32_t   chr,
-              llama_grammar_stacks & stacks_new);
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stacks        & stacks,
+                                 uint32_t   chr,
+              llama_grammar_stacks        & stacks_new,
+              llama_grammar_advance_cache * cache = nullptr);
 
 std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stack      & stack,
-        const llama_grammar_candidates & candidates);
+        const llama_grammar_rules         & rules,
+        const llama_grammar_stack         & stack,
+        const llama_grammar_candidates    & candidates,
+              llama_grammar_advance_cache * cache = nullptr);
 
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
@@ -106,6 +114,34 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// node of the prefix trie of the decoded vocab
+struct llama_grammar_trie_node {
+    uint32_t chr; // code point on the edge from the parent
+
+    uint32_t child_begin; // children, sorted by chr
+    uint32_t child_end;
+
+    uint32_t tok_begin; // candidates whose decoded piece ends at this node
+    uint32_t tok_end;
+};
+
+// the decoded vocab and its prefix trie, built once per vocab and shared by all the grammars (llama_vocab::grammar_trie)
+struct llama_grammar_vocab_trie {
+    std::vector<uint32_t>    code_points; // decoded pieces of the tokens, each terminated by 0
+    llama_grammar_candidates candidates;  // the tokens that are matched against the grammar (not EOG, non-empty), sorted by code points
+
+    std::vector<llama_grammar_trie_node> trie; // prefix trie of the candidates, trie[0] is the root
+};
+
+// allowed tokens of each grammar stack that has been seen at a code point boundary
+// the mask of a stack is computed by walking the trie of the vocab the first time the stack is seen, after which
+// applying the grammar to the candidates is a lookup in the union of the masks of the current stacks
+struct llama_grammar_mask_cache {
+    std::shared_ptr<const llama_grammar_vocab_trie> vocab_trie;
+
+    std::map<llama_grammar_stack, std::vector<uint32_t>> masks; // bit (id % 32) of masks[id / 32] is set if token id is allowed
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
@@ -115,6 +151,12 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // built on the first application of the grammar to the whole vocab, not shared with clones
+    mutable std::unique_ptr<llama_grammar_mask_cache> mask_cache;
+
+    // points to the elements of rules, not shared with clones
+    mutable llama_grammar_advance_cache advance_cache;
 };
 
 //
@@ -139,6 +181,11 @@ void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
+// writes the tokens allowed by the grammar to a token mask of (n_vocab + 31)/32 words, see llama_token_mask_apply
+void llama_grammar_get_mask_impl(
+        const struct llama_grammar & grammar,
+                          uint32_t * mask);
+
 void llama_grammar_accept_impl(
               struct llama_grammar & grammar,
                        llama_token   token);
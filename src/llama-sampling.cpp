@@ -10,6 +10,7 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <ctime>
 #include <numeric>
 #include <random>
@@ -243,6 +244,14 @@ struct llama_sampler * llama_sampler_clone(const struct llama_sampler * smpl) {
     GGML_ABORT("the sampler does not support cloning");
 }
 
+bool llama_sampler_get_mask(const struct llama_sampler * smpl, uint32_t * mask, int32_t n_vocab) {
+    if (smpl->iface->get_mask) {
+        return smpl->iface->get_mask(smpl, mask, n_vocab);
+    }
+
+    return false;
+}
+
 void llama_sampler_free(struct llama_sampler * smpl) {
     if (smpl == nullptr) {
         return;
@@ -255,6 +264,214 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
+void llama_token_mask_apply(float * logits, const uint32_t * mask, int32_t n_vocab) {
+    const int32_t n_words = n_vocab/32;
+
+    for (int32_t iw = 0; iw < n_words; ++iw) {
+        const uint32_t word = mask[iw];
+
+        // most words are either fully allowed or fully rejected
+        if (word == UINT32_MAX) {
+            continue;
+        }
+
+        float * l = logits + 32*iw;
+
+        if (word == 0) {
+            std::fill(l, l + 32, -INFINITY);
+            continue;
+        }
+
+        // branchless, so that the compiler can vectorize it
+        for (int j = 0; j < 32; ++j) {
+            l[j] = (word >> j) & 1 ? l[j] : -INFINITY;
+        }
+    }
+
+    for (int32_t i = 32*n_words; i < n_vocab; ++i) {
+        if (!((mask[i / 32] >> (i % 32)) & 1)) {
+            logits[i] = -INFINITY;
+        }
+    }
+}
+
+// max of the logits, with independent lanes so that the compiler can vectorize it
+static float llama_logits_max(const float * logits, int32_t n) {
+    float lanes[8];
+    std::fill(lanes, lanes + 8, -INFINITY);
+
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int j = 0; j < 8; ++j) {
+            lanes[j] = logits[i + j] > lanes[j] ? logits[i + j] : lanes[j];
+        }
+    }
+
+    float res = *std::max_element(lanes, lanes + 8);
+    for (; i < n; ++i) {
+        res = std::max(res, logits[i]);
+    }
+
+    return res;
+}
+
+// number of logits sampled to estimate the threshold of the top-k
+#define LLAMA_LOGITS_N_SAMPLE 4096
+
+// a value that is likely below the k-th largest logit, estimated from a strided sample of the logits
+static float llama_logits_estimate_kth(const float * logits, int32_t n_vocab, int32_t k) {
+    const int32_t n_sample = std::min(n_vocab, LLAMA_LOGITS_N_SAMPLE);
+    const int32_t stride   = n_vocab/n_sample;
+
+    // twice the expected rank of the k-th largest logit in the sample, plus some margin for small k
+    const int64_t rank = 2*(int64_t) k*n_sample/n_vocab + 8;
+    if (rank >= n_sample) {
+        return -INFINITY;
+    }
+
+    std::vector<float> sample(n_sample);
+    for (int32_t i = 0; i < n_sample; ++i) {
+        sample[i] = logits[(int64_t) i*stride];
+    }
+
+    std::nth_element(sample.begin(), sample.begin() + rank, sample.end(), std::greater<float>());
+
+    return sample[rank];
+}
+
+size_t llama_logits_get_candidates(
+               const float * logits,
+                   int32_t   n_vocab,
+                   int32_t   top_k,
+                     float   min_p,
+                    size_t   min_keep,
+         const llama_token * keep,
+                    size_t   n_keep,
+    struct llama_token_data * data) {
+    std::vector<llama_token> keep_ids;
+    for (size_t i = 0; i < n_keep; ++i) {
+        if (keep[i] >= 0 && keep[i] < n_vocab) {
+            keep_ids.push_back(keep[i]);
+        }
+    }
+    std::sort(keep_ids.begin(), keep_ids.end());
+    keep_ids.erase(std::unique(keep_ids.begin(), keep_ids.end()), keep_ids.end());
+
+    if (top_k <= 0 && min_p <= 0.0f) {
+        for (int32_t i = 0; i < n_vocab; ++i) {
+            data[i] = { i, logits[i], 0.0f };
+        }
+        return n_vocab;
+    }
+
+    // initial guess of the threshold
+    // note: the logits of the kept tokens can still change, so the thresholds are computed without them
+    float threshold = -INFINITY;
+    if (top_k > 0) {
+        threshold = llama_logits_estimate_kth(logits, n_vocab, top_k + (int32_t) keep_ids.size());
+    }
+    if (min_p > 0.0f) {
+        threshold = std::max(threshold, llama_logits_max(logits, n_vocab) + logf(min_p));
+    }
+
+    std::vector<float> logits_other;
+
+    while (true) {
+        size_t n = 0;
+        for (int32_t i = 0; i < n_vocab; ++i) {
+            if (logits[i] >= threshold) {
+                data[n++] = { i, logits[i], 0.0f };
+            }
+        }
+
+        // add the kept tokens that are below the threshold, keeping the order of the ids
+        const size_t n_above = n;
+        for (const llama_token id : keep_ids) {
+            if (!(logits[id] >= threshold)) {
+                data[n++] = { id, logits[id], 0.0f };
+            }
+        }
+        std::inplace_merge(data, data + n_above, data + n, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.id < b.id;
+        });
+
+        if (threshold == -INFINITY) {
+            // all the tokens are candidates
+            return n;
+        }
+
+        if (top_k <= 0 && keep_ids.empty() && n >= min_keep) {
+            // the min-p threshold computed from the max of all the logits is exact
+            return n;
+        }
+
+        // the logits of the other tokens that are above the threshold
+        logits_other.clear();
+        for (size_t i = 0, ik = 0; i < n; ++i) {
+            while (ik < keep_ids.size() && keep_ids[ik] < data[i].id) {
+                ++ik;
+            }
+            if (ik == keep_ids.size() || keep_ids[ik] != data[i].id) {
+                logits_other.push_back(data[i].logit);
+            }
+        }
+
+        // the exact thresholds, valid if enough of the other tokens are above the guess
+        bool  ok    = true;
+        float t_new = -INFINITY;
+
+        auto kth = [&](size_t k) {
+            std::nth_element(logits_other.begin(), logits_other.begin() + (k - 1), logits_other.end(), std::greater<float>());
+            return logits_other[k - 1];
+        };
+
+        if (top_k > 0) {
+            if (logits_other.size() >= (size_t) top_k) {
+                t_new = kth(top_k);
+            } else {
+                ok = false;
+            }
+        }
+
+        if (ok && min_p > 0.0f) {
+            if (!logits_other.empty()) {
+                // min logit for p_i >= p * p_max, the max can only be higher after the kept tokens change
+                float t_p = *std::max_element(logits_other.begin(), logits_other.end()) + logf(min_p);
+
+                if (min_keep > 0) {
+                    if (logits_other.size() >= min_keep) {
+                        t_p = std::min(t_p, kth(min_keep));
+                    } else {
+                        ok = false;
+                    }
+                }
+
+                t_new = std::max(t_new, t_p);
+            } else {
+                ok = false;
+            }
+        }
+
+        if (ok && t_new >= threshold) {
+            // drop the tokens that are below the exact threshold
+            size_t n_res = 0;
+            for (size_t i = 0, ik = 0; i < n; ++i) {
+                while (ik < keep_ids.size() && keep_ids[ik] < data[i].id) {
+                    ++ik;
+                }
+                if (data[i].logit >= t_new || (ik < keep_ids.size() && keep_ids[ik] == data[i].id)) {
+                    data[n_res++] = data[i];
+                }
+            }
+
+            return n_res;
+        }
+
+        // the guess was too high - retry with the exact threshold if it is known, or with all the tokens
+        threshold = ok ? t_new : -INFINITY;
+    }
+}
+
 llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
     const auto * logits = llama_get_logits_ith(ctx, idx);
 
@@ -347,12 +564,13 @@ static void llama_sampler_chain_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_chain_i = {
-    /* .name   = */ llama_sampler_chain_name,
-    /* .accept = */ llama_sampler_chain_accept,
-    /* .apply  = */ llama_sampler_chain_apply,
-    /* .reset  = */ llama_sampler_chain_reset,
-    /* .clone  = */ llama_sampler_chain_clone,
-    /* .free   = */ llama_sampler_chain_free,
+    /* .name     = */ llama_sampler_chain_name,
+    /* .accept   = */ llama_sampler_chain_accept,
+    /* .apply    = */ llama_sampler_chain_apply,
+    /* .reset    = */ llama_sampler_chain_reset,
+    /* .clone    = */ llama_sampler_chain_clone,
+    /* .free     = */ llama_sampler_chain_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_params params) {
@@ -421,12 +639,13 @@ static void llama_sampler_greedy_apply(struct llama_sampler * /*smpl*/, llama_to
 }
 
 static struct llama_sampler_i llama_sampler_greedy_i = {
-    /* .name   = */ llama_sampler_greedy_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_greedy_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ nullptr,
-    /* .free   = */ nullptr,
+    /* .name     = */ llama_sampler_greedy_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_greedy_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ nullptr,
+    /* .free     = */ nullptr,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_greedy() {
@@ -482,12 +701,13 @@ static void llama_sampler_dist_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_dist_i = {
-    /* .name   = */ llama_sampler_dist_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_dist_apply,
-    /* .reset  = */ llama_sampler_dist_reset,
-    /* .clone  = */ llama_sampler_dist_clone,
-    /* .free   = */ llama_sampler_dist_free,
+    /* .name     = */ llama_sampler_dist_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_dist_apply,
+    /* .reset    = */ llama_sampler_dist_reset,
+    /* .clone    = */ llama_sampler_dist_clone,
+    /* .free     = */ llama_sampler_dist_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_dist(uint32_t seed) {
@@ -513,12 +733,13 @@ static void llama_sampler_softmax_apply(struct llama_sampler * /*smpl*/, llama_t
 }
 
 static struct llama_sampler_i llama_sampler_softmax_i = {
-    /* .name   = */ llama_sampler_softmax_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_softmax_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ nullptr,
-    /* .free   = */ nullptr,
+    /* .name     = */ llama_sampler_softmax_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_softmax_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ nullptr,
+    /* .free     = */ nullptr,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_softmax() {
@@ -553,12 +774,13 @@ static void llama_sampler_top_k_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_top_k_i = {
-    /* .name   = */ llama_sampler_top_k_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_top_k_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_top_k_clone,
-    /* .free   = */ llama_sampler_top_k_free,
+    /* .name     = */ llama_sampler_top_k_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_top_k_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_top_k_clone,
+    /* .free     = */ llama_sampler_top_k_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_top_k(int32_t k) {
@@ -619,12 +841,13 @@ static void llama_sampler_top_p_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_top_p_i = {
-    /* .name   = */ llama_sampler_top_p_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_top_p_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_top_p_clone,
-    /* .free   = */ llama_sampler_top_p_free,
+    /* .name     = */ llama_sampler_top_p_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_top_p_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_top_p_clone,
+    /* .free     = */ llama_sampler_top_p_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_top_p(float p, size_t min_keep) {
@@ -715,12 +938,13 @@ static void llama_sampler_min_p_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_min_p_i = {
-    /* .name   = */ llama_sampler_min_p_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_min_p_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_min_p_clone,
-    /* .free   = */ llama_sampler_min_p_free,
+    /* .name     = */ llama_sampler_min_p_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_min_p_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_min_p_clone,
+    /* .free     = */ llama_sampler_min_p_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_min_p(float p, size_t min_keep) {
@@ -810,12 +1034,13 @@ static void llama_sampler_tail_free_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_tail_free_i = {
-    /* .name   = */ llama_sampler_tail_free_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_tail_free_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_tail_free_clone,
-    /* .free   = */ llama_sampler_tail_free_free,
+    /* .name     = */ llama_sampler_tail_free_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_tail_free_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_tail_free_clone,
+    /* .free     = */ llama_sampler_tail_free_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_tail_free(float z, size_t min_keep) {
@@ -909,12 +1134,13 @@ static void llama_sampler_typical_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_typical_i = {
-    /* .name   = */ llama_sampler_typical_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_typical_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_typical_clone,
-    /* .free   = */ llama_sampler_typical_free,
+    /* .name     = */ llama_sampler_typical_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_typical_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_typical_clone,
+    /* .free     = */ llama_sampler_typical_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_typical(float p, size_t min_keep) {
@@ -953,12 +1179,13 @@ static void llama_sampler_temp_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_temp_i = {
-    /* .name   = */ llama_sampler_temp_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_temp_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_temp_clone,
-    /* .free   = */ llama_sampler_temp_free,
+    /* .name     = */ llama_sampler_temp_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_temp_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_temp_clone,
+    /* .free     = */ llama_sampler_temp_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_temp(float temp) {
@@ -1063,12 +1290,13 @@ static void llama_sampler_temp_ext_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_temp_ext_i = {
-    /* .name   = */ llama_sampler_temp_ext_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_temp_ext_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_temp_ext_clone,
-    /* .free   = */ llama_sampler_temp_ext_free,
+    /* .name     = */ llama_sampler_temp_ext_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_temp_ext_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_temp_ext_clone,
+    /* .free     = */ llama_sampler_temp_ext_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_temp_ext(float temp, float delta, float exponent) {
@@ -1154,12 +1382,13 @@ static void llama_sampler_xtc_reset(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_xtc_i = {
-    /* .name   = */ llama_sampler_xtc_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sample_xtc_apply,
-    /* .reset  = */ llama_sampler_xtc_reset,
-    /* .clone  = */ llama_sampler_xtc_clone,
-    /* .free   = */ llama_sampler_xtc_free,
+    /* .name     = */ llama_sampler_xtc_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sample_xtc_apply,
+    /* .reset    = */ llama_sampler_xtc_reset,
+    /* .clone    = */ llama_sampler_xtc_clone,
+    /* .free     = */ llama_sampler_xtc_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_xtc(float p, float t, size_t min_keep, uint32_t seed) {
@@ -1261,12 +1490,13 @@ static void llama_sampler_mirostat_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_mirostat_i = {
-    /* .name   = */ llama_sampler_mirostat_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_mirostat_apply,
-    /* .reset  = */ llama_sampler_mirostat_reset,
-    /* .clone  = */ llama_sampler_mirostat_clone,
-    /* .free   = */ llama_sampler_mirostat_free,
+    /* .name     = */ llama_sampler_mirostat_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_mirostat_apply,
+    /* .reset    = */ llama_sampler_mirostat_reset,
+    /* .clone    = */ llama_sampler_mirostat_clone,
+    /* .free     = */ llama_sampler_mirostat_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_mirostat(int32_t n_vocab, uint32_t seed, float tau, float eta, int32_t m) {
@@ -1360,12 +1590,13 @@ static void llama_sampler_mirostat_v2_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_mirostat_v2_i = {
-    /* .name   = */ llama_sampler_mirostat_v2_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_mirostat_v2_apply,
-    /* .reset  = */ llama_sampler_mirostat_v2_reset,
-    /* .clone  = */ llama_sampler_mirostat_v2_clone,
-    /* .free   = */ llama_sampler_mirostat_v2_free,
+    /* .name     = */ llama_sampler_mirostat_v2_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_mirostat_v2_apply,
+    /* .reset    = */ llama_sampler_mirostat_v2_reset,
+    /* .clone    = */ llama_sampler_mirostat_v2_clone,
+    /* .free     = */ llama_sampler_mirostat_v2_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_mirostat_v2(uint32_t seed, float tau, float eta) {
@@ -1412,6 +1643,19 @@ static void llama_sampler_grammar_apply(struct llama_sampler * smpl, llama_token
     }
 }
 
+static bool llama_sampler_grammar_get_mask(const struct llama_sampler * smpl, uint32_t * mask, int32_t n_vocab) {
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (!ctx->grammar) {
+        return false;
+    }
+
+    GGML_ASSERT(n_vocab == (int32_t) ctx->vocab->n_vocab);
+
+    llama_grammar_get_mask_impl(*ctx->grammar, mask);
+
+    return true;
+}
+
 static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_grammar *) smpl->ctx;
     if (!ctx->grammar) {
@@ -1455,12 +1699,13 @@ static void llama_sampler_grammar_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_grammar_i = {
-    /* .name   = */ llama_sampler_grammar_name,
-    /* .accept = */ llama_sampler_grammar_accept_impl,
-    /* .apply  = */ llama_sampler_grammar_apply,
-    /* .reset  = */ llama_sampler_grammar_reset,
-    /* .clone  = */ llama_sampler_grammar_clone,
-    /* .free   = */ llama_sampler_grammar_free,
+    /* .name     = */ llama_sampler_grammar_name,
+    /* .accept   = */ llama_sampler_grammar_accept_impl,
+    /* .apply    = */ llama_sampler_grammar_apply,
+    /* .reset    = */ llama_sampler_grammar_reset,
+    /* .clone    = */ llama_sampler_grammar_clone,
+    /* .free     = */ llama_sampler_grammar_free,
+    /* .get_mask = */ llama_sampler_grammar_get_mask,
 };
 
 struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab & vocab, const char * grammar_str, const char * grammar_root) {
@@ -1504,6 +1749,9 @@ struct llama_sampler_penalties {
     const bool    ignore_eos;
 
     ring_buffer<llama_token> prev;
+
+    // a frequency map to count occurrences of each token in prev, updated as the tokens enter and leave the window
+    std::unordered_map<llama_token, int> token_count;
 };
 
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
@@ -1516,7 +1764,28 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
+    if (ctx->prev.size() == (size_t) ctx->penalty_last_n) {
+        // the oldest token leaves the window
+        const auto token_iter = ctx->token_count.find(ctx->prev.front());
+        if (--token_iter->second == 0) {
+            ctx->token_count.erase(token_iter);
+        }
+    }
+
     ctx->prev.push_back(token);
+    ctx->token_count[token]++;
+}
+
+static void llama_sampler_penalties_apply_one(const llama_sampler_penalties * ctx, llama_token_data & cur, int count) {
+    // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+    // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+    if (cur.logit <= 0) {
+        cur.logit *= ctx->penalty_repeat;
+    } else {
+        cur.logit /= ctx->penalty_repeat;
+    }
+
+    cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
 }
 
 static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
@@ -1568,33 +1837,30 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         }
     }
 
-    // Create a frequency map to count occurrences of each token in last_tokens
-    // TODO: optimize this by maintaining the token count in the sampler context
-    using llama_token_cnt = std::unordered_map<llama_token, int>;
-    llama_token_cnt token_count;
-
-    for (int i = 0; i < std::min<int>(ctx->penalty_last_n, ctx->prev.size()); ++i) {
-        token_count[ctx->prev.rat(i)]++;
+    // if each penalized token is at the index of its id (candidates not yet sorted/shuffled/truncated), only these
+    // entries are visited, else the candidates are looked up in the frequency map
+    bool indexed = true;
+    for (const auto & it : ctx->token_count) {
+        if ((size_t) it.first >= cur_p->size || cur_p->data[it.first].id != it.first) {
+            indexed = false;
+            break;
+        }
     }
 
     // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = token_count.find(cur_p->data[i].id);
-        if (token_iter == token_count.end()) {
-            continue;
+    if (indexed) {
+        for (const auto & it : ctx->token_count) {
+            llama_sampler_penalties_apply_one(ctx, cur_p->data[it.first], it.second);
         }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
+            if (token_iter == ctx->token_count.end()) {
+                continue;
+            }
 
-        const int count = token_iter->second;
-
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
-        } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            llama_sampler_penalties_apply_one(ctx, cur_p->data[i], token_iter->second);
         }
-
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
     }
 
     cur_p->sorted = false;
@@ -1608,6 +1874,7 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
 static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
     ctx->prev.clear();
+    ctx->token_count.clear();
 }
 
 static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_sampler * smpl) {
@@ -1627,7 +1894,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1638,12 +1906,13 @@ static void llama_sampler_penalties_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_penalties_i = {
-    /* .name   = */ llama_sampler_penalties_name,
-    /* .accept = */ llama_sampler_penalties_accept,
-    /* .apply  = */ llama_sampler_penalties_apply,
-    /* .reset  = */ llama_sampler_penalties_reset,
-    /* .clone  = */ llama_sampler_penalties_clone,
-    /* .free   = */ llama_sampler_penalties_free,
+    /* .name     = */ llama_sampler_penalties_name,
+    /* .accept   = */ llama_sampler_penalties_accept,
+    /* .apply    = */ llama_sampler_penalties_apply,
+    /* .reset    = */ llama_sampler_penalties_reset,
+    /* .clone    = */ llama_sampler_penalties_clone,
+    /* .free     = */ llama_sampler_penalties_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_penalties(
@@ -1679,6 +1948,7 @@ struct llama_sampler * llama_sampler_init_penalties(
             /* .penalize_nl     = */ penalize_nl,
             /* .ignore_eos      = */ ignore_eos,
             /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
+            /* .token_count     = */ {},
         },
     };
 }
@@ -1740,12 +2010,13 @@ static void llama_sampler_logit_bias_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_logit_bias_i = {
-    /* .name   = */ llama_sampler_logit_bias_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_logit_bias_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_logit_bias_clone,
-    /* .free   = */ llama_sampler_logit_bias_free,
+    /* .name     = */ llama_sampler_logit_bias_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_logit_bias_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_logit_bias_clone,
+    /* .free     = */ llama_sampler_logit_bias_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_logit_bias(
@@ -1965,12 +2236,13 @@ static void llama_sampler_infill_free(struct llama_sampler * smpl) {
 }
 
 static struct llama_sampler_i llama_sampler_infill_i = {
-    /* .name   = */ llama_sampler_infill_name,
-    /* .accept = */ nullptr,
-    /* .apply  = */ llama_sampler_infill_apply,
-    /* .reset  = */ nullptr,
-    /* .clone  = */ llama_sampler_infill_clone,
-    /* .free   = */ llama_sampler_infill_free,
+    /* .name     = */ llama_sampler_infill_name,
+    /* .accept   = */ nullptr,
+    /* .apply    = */ llama_sampler_infill_apply,
+    /* .reset    = */ nullptr,
+    /* .clone    = */ llama_sampler_infill_clone,
+    /* .free     = */ llama_sampler_infill_free,
+    /* .get_mask = */ nullptr,
 };
 
 struct llama_sampler * llama_sampler_init_infill_impl(
@@ -3,14 +3,18 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
 #include <cstring>
+#include <exception>
 #include <forward_list>
+#include <mutex>
 #include <queue>
 #include <sstream>
+#include <thread>
 
 //
 // helpers
@@ -350,6 +354,12 @@ public:
     void pop() =  delete;
 };
 
+struct llm_symbol_bpe : llm_symbol {
+    llama_vocab::id id; // -1 if the text of the symbol is not a token
+};
+
+static_assert(std::is_trivially_copyable<llm_symbol_bpe>::value, "llm_symbol_bpe is not trivially copyable");
+
 struct llm_bigram_bpe {
     struct comparator {
         bool operator()(const llm_bigram_bpe & l, const llm_bigram_bpe & r) const {
@@ -361,11 +371,81 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id id; // token of the merged pair, -1 if not in the vocab
     int rank;
     size_t size;
 };
 
+// open-addressing hash table of the BPE merges keyed on (left, right) token ids
+// avoids building strings and doing string compares for every candidate bigram
+struct llm_bpe_merge_table {
+    struct entry {
+        uint64_t key;
+        int32_t  rank;
+        llama_vocab::id id;
+    };
+
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+
+    void build(const llama_vocab & vocab) {
+        size_t n_cap = 16;
+        while (n_cap < 2*vocab.bpe_ranks.size()) {
+            n_cap *= 2;
+        }
+        entries.assign(n_cap, entry{EMPTY, -1, -1});
+        mask = n_cap - 1;
+
+        for (const auto & it : vocab.bpe_ranks) {
+            const auto left  = vocab.token_to_id.find(it.first.first);
+            const auto right = vocab.token_to_id.find(it.first.second);
+            if (left == vocab.token_to_id.end() || right == vocab.token_to_id.end()) {
+                // only reachable through symbols that are not tokens - handled by the string lookup
+                continue;
+            }
+
+            const auto merged = vocab.token_to_id.find(it.first.first + it.first.second);
+
+            const uint64_t key = make_key(left->second, right->second);
+            size_t i = hash(key) & mask;
+            while (entries[i].key != EMPTY && entries[i].key != key) {
+                i = (i + 1) & mask;
+            }
+            entries[i].key  = key;
+            entries[i].rank = it.second;
+            entries[i].id   = merged == vocab.token_to_id.end() ? -1 : merged->second;
+        }
+    }
+
+    // returns nullptr if the pair is not a merge
+    const entry * find(llama_vocab::id left, llama_vocab::id right) const {
+        const uint64_t key = make_key(left, right);
+        for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            const entry & e = entries[i];
+            if (e.key == key) {
+                return &e;
+            }
+            if (e.key == EMPTY) {
+                return nullptr;
+            }
+        }
+    }
+
+private:
+    static uint64_t make_key(llama_vocab::id left, llama_vocab::id right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return (size_t) key;
+    }
+
+    std::vector<entry> entries;
+    size_t mask = 0;
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) : llm_tokenizer() {
         GGML_ASSERT(vocab.type == LLAMA_VOCAB_TYPE_BPE);
@@ -488,9 +568,13 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        merges.build(vocab);
     }
 
     std::vector<std::string> regex_exprs;
+
+    llm_bpe_merge_table merges;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -547,16 +631,26 @@ struct llm_tokenizer_bpe_session {
             int index = 0;
             size_t offset = 0;
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+            if (vocab.tokenizer_ignore_merges) {
+                const auto token = vocab.token_to_id.find(word);
+                if (token != vocab.token_to_id.end()) {
+                    llm_symbol_bpe sym;
+                    sym.text = word.c_str();
+                    sym.n    = word.size();
+                    sym.prev = -1;
+                    sym.next = -1;
+                    sym.id   = token->second;
+                    symbols.emplace_back(sym);
+                    offset = word.size();
+                }
             }
 
             while (offset < word.size()) {
-                llm_symbol sym;
+                llm_symbol_bpe sym;
                 size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
                 sym.text = word.c_str() + offset;
                 sym.n = char_len;
+                sym.id = find_token(sym.text, sym.n);
                 offset += sym.n;
                 sym.prev = index - 1;
                 sym.next = offset == word.size() ? -1 : index + 1;
@@ -577,14 +671,13 @@ struct llm_tokenizer_bpe_session {
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
+                if (left_symbol.n + right_symbol.n != bigram.size) {
                     continue;  // Skip this bigram if it's outdated
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
+                left_symbol.id = bigram.id;
                 right_symbol.n = 0;
 
                 // remove the right sym from the chain
@@ -620,19 +713,16 @@ struct llm_tokenizer_bpe_session {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
+                if (symbol.id < 0) {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        std::string byte_str(1, symbol.text[j]);
                         auto token_multibyte = vocab.token_to_id.find(byte_str);
                         if (token_multibyte != vocab.token_to_id.end()) {
                             output.push_back(token_multibyte->second);
                         }
                     }
                 } else {
-                    output.push_back((*token).second);
+                    output.push_back(symbol.id);
                 }
             }
         }
@@ -643,33 +733,49 @@ private:
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const llm_symbol_bpe & left_symbol  = symbols[left];
+        const llm_symbol_bpe & right_symbol = symbols[right];
 
-        int rank_found = -1;
+        llm_bigram_bpe bigram;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (left_symbol.id >= 0 && right_symbol.id >= 0) {
+            const auto * merge = bpe_tokenizer->merges.find(left_symbol.id, right_symbol.id);
+            if (merge == nullptr) {
+                return;
+            }
+            bigram.rank = merge->rank;
+            bigram.id   = merge->id;
+        } else {
+            // slow path for symbols that are not in the vocab
+            std::string left_token  = std::string(left_symbol.text,  left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
 
-        if (rank_found < 0) {
-            return;
+            bigram.rank = vocab.find_bpe_rank(left_token, right_token);
+            if (bigram.rank < 0) {
+                return;
+            }
+            bigram.id = find_token(left_symbol.text, left_symbol.n + right_symbol.n);
         }
 
-        llm_bigram_bpe bigram;
-
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.size  = left_symbol.n + right_symbol.n;
 
         work_queue.push(bigram);
     }
 
+    llama_vocab::id find_token(const char * text, size_t n) {
+        tmp.assign(text, n);
+        const auto token = vocab.token_to_id.find(tmp);
+        return token == vocab.token_to_id.end() ? -1 : token->second;
+    }
+
     const llama_vocab & vocab;
     const llm_tokenizer_bpe * bpe_tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::string tmp;
+    std::vector<llm_symbol_bpe> symbols;
+    std::vector<llm_symbol_bpe> symbols_final;
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1752,6 +1858,174 @@ int32_t llama_tokenize_impl(
     return res.size();
 }
 
+// long texts are split into chunks of about this many bytes for parallel tokenization
+static const size_t LLAMA_TOKENIZE_CHUNK_SIZE = 64*1024;
+
+static bool llama_is_ascii_letter(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+
+// find the positions where the text can be split without changing the result of the tokenization
+// the split is placed before a single space between two ASCII letters: all pre-tokenizers end a word
+// there and start the next one with the space. only the tokenizers that never merge across
+// pre-tokenizer words (BPE, WPM) are split
+static std::vector<size_t> llama_tokenize_find_splits(const llama_vocab & vocab, const char * text, size_t text_len) {
+    std::vector<size_t> splits;
+
+    if (vocab.type != LLAMA_VOCAB_TYPE_BPE && vocab.type != LLAMA_VOCAB_TYPE_WPM) {
+        return splits;
+    }
+
+    // special tokens are matched before pre-tokenization - they must not cross or be affected by the split
+    for (const llama_vocab::id id : vocab.cache_special_tokens) {
+        const auto & data = vocab.id_to_token[id];
+        if (data.text.find(' ') != std::string::npos) {
+            return splits;
+        }
+        if ((data.attr & LLAMA_TOKEN_ATTR_RSTRIP) && !data.text.empty() && llama_is_ascii_letter(data.text.back())) {
+            return splits;
+        }
+    }
+
+    for (size_t pos = LLAMA_TOKENIZE_CHUNK_SIZE; pos + 1 < text_len; ) {
+        if (text[pos] == ' ' && llama_is_ascii_letter(text[pos - 1]) && llama_is_ascii_letter(text[pos + 1])) {
+            splits.push_back(pos);
+            pos += LLAMA_TOKENIZE_CHUNK_SIZE;
+        } else {
+            pos++;
+        }
+    }
+
+    return splits;
+}
+
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+               const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads) {
+    struct chunk {
+        int32_t text;
+        size_t  offset;
+        size_t  length;
+        bool    add_special;
+    };
+
+    // split the texts into independent chunks
+    std::vector<chunk> chunks;
+    std::vector<size_t> text_chunks(n_texts + 1, 0); // first chunk of each text
+    for (int32_t i = 0; i < n_texts; ++i) {
+        text_chunks[i] = chunks.size();
+
+        const size_t text_len = text_lens[i];
+        const auto splits = n_threads > 1 ? llama_tokenize_find_splits(vocab, texts[i], text_len) : std::vector<size_t>();
+        if (splits.empty()) {
+            chunks.push_back({ i, 0, text_len, add_special });
+            continue;
+        }
+
+        // the special tokens are added to the whole text below
+        size_t prev = 0;
+        for (size_t split : splits) {
+            chunks.push_back({ i, prev, split - prev, false });
+            prev = split;
+        }
+        chunks.push_back({ i, prev, text_len - prev, false });
+    }
+    text_chunks[n_texts] = chunks.size();
+
+    // tokenize the chunks, each thread with its own tokenizer sessions
+    std::vector<std::vector<llama_vocab::id>> results(chunks.size());
+    std::atomic<size_t> next_chunk(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        size_t idx;
+        while ((idx = next_chunk++) < chunks.size()) {
+            const chunk & c = chunks[idx];
+            try {
+                results[idx] = llama_tokenize_internal(vocab, std::string(texts[c.text] + c.offset, c.length), c.add_special, parse_special);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                error = std::current_exception();
+            }
+        }
+    };
+
+    const size_t n_workers = std::min<size_t>(std::max<int32_t>(n_threads, 1), chunks.size());
+    if (n_workers > 1) {
+        std::vector<std::thread> workers;
+        workers.reserve(n_workers - 1);
+        for (size_t i = 0; i < n_workers - 1; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto & w : workers) {
+            w.join();
+        }
+    } else {
+        worker();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // concatenate the results
+    int32_t n_total = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        const bool split = text_chunks[i + 1] - text_chunks[i] > 1;
+
+        std::vector<llama_vocab::id> prefix;
+        std::vector<llama_vocab::id> suffix;
+        if (split && add_special) {
+            if (vocab.type == LLAMA_VOCAB_TYPE_WPM) {
+                prefix.push_back(vocab.special_cls_id);
+                suffix.push_back(vocab.special_sep_id);
+            } else {
+                if (vocab.tokenizer_add_bos) {
+                    prefix.push_back(vocab.special_bos_id);
+                }
+                if (vocab.tokenizer_add_eos) {
+                    suffix.push_back(vocab.special_eos_id);
+                }
+            }
+        }
+
+        int32_t n = 0;
+        auto append = [&](const std::vector<llama_vocab::id> & ids) {
+            for (const auto id : ids) {
+                if (n_total + n < n_tokens_max) {
+                    tokens[n_total + n] = id;
+                }
+                n++;
+            }
+        };
+
+        append(prefix);
+        for (size_t j = text_chunks[i]; j < text_chunks[i + 1]; ++j) {
+            append(results[j]);
+        }
+        append(suffix);
+
+        n_tokens[i] = n;
+        n_total += n;
+    }
+
+    if (n_total > n_tokens_max) {
+        return -n_total;
+    }
+
+    return n_total;
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
 
@@ -1796,13 +2070,10 @@ int32_t llama_token_to_piece_impl(const struct llama_vocab & vocab, llama_token
     };
 
     // if we have a cache - use it
-    {
-        const auto & cache = vocab.cache_token_to_piece;
-
-        if (!cache.empty()) {
-            const auto & result = cache.at(token);
-            return _try_copy(result.data(), result.size());
-        }
+    if (!vocab.cache_piece_offs.empty()) {
+        size_t size;
+        const char * piece = vocab.cache_get_piece(token, size);
+        return _try_copy(piece, size);
     }
 
     if (0 <= token && token < (int32_t) vocab.id_to_token.size()) {
@@ -1888,17 +2159,51 @@ int32_t llama_detokenize_impl(
         }
     }
 
-    for (int32_t i = 0; i < n_tokens; ++i) {
-        GGML_ASSERT(avail >= 0);
-        int32_t n_chars = llama_token_to_piece_impl(vocab, tokens[i], text, avail, remove_space, unparse_special);
-        remove_space = false;
-        if (n_chars < 0) {
-            avail = 0;
-            total -= n_chars;
-        } else if (n_chars > 0) {
-            avail -= n_chars;
-            text  += n_chars;
-            total += n_chars;
+    if (!vocab.cache_piece_offs.empty()) {
+        // fast path: copy the pieces straight from the cache
+        static const int attr_special = LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_CONTROL;
+
+        const char     * data = vocab.cache_piece_data.data();
+        const uint32_t * offs = vocab.cache_piece_offs.data();
+
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            const llama_token token = tokens[i];
+            const bool lstrip = remove_space;
+            remove_space = false;
+
+            if (!unparse_special && (vocab.id_to_token.at(token).attr & attr_special)) {
+                continue;
+            }
+
+            const char * piece = data + offs[token];
+            int32_t      size  = offs[token + 1] - offs[token] - 1;
+            if (lstrip && size > 0 && *piece == ' ') {
+                piece++;
+                size--;
+            }
+
+            if (size <= avail) {
+                memcpy(text, piece, size);
+                text  += size;
+                avail -= size;
+            } else {
+                avail = 0;
+            }
+            total += size;
+        }
+    } else {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            GGML_ASSERT(avail >= 0);
+            int32_t n_chars = llama_token_to_piece_impl(vocab, tokens[i], text, avail, remove_space, unparse_special);
+            remove_space = false;
+            if (n_chars < 0) {
+                avail = 0;
+                total -= n_chars;
+            } else if (n_chars > 0) {
+                avail -= n_chars;
+                text  += n_chars;
+                total += n_chars;
+            }
         }
     }
 
@@ -6,8 +6,11 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <set>
 
+struct llama_grammar_vocab_trie;
+
 struct llm_tokenizer;
 
 struct llama_vocab {
@@ -32,7 +35,14 @@ struct llama_vocab {
     std::vector<token_data>       id_to_token;
 
     std::vector<id>    cache_special_tokens;
-    std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // llama_token_to_piece(special = true) of all tokens, null-terminated and stored back to back
+    std::vector<char>     cache_piece_data;
+    std::vector<uint32_t> cache_piece_offs; // n_vocab + 1 offsets into cache_piece_data
+
+    // decoded pieces and their prefix trie, built on the first use by a grammar - see llama-grammar.cpp
+    // note: accessed with std::atomic_load/std::atomic_store
+    mutable std::shared_ptr<const llama_grammar_vocab_trie> grammar_trie;
 
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
@@ -80,6 +90,13 @@ struct llama_vocab {
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
 
+    // cached piece of the token, null-terminated
+    const char * cache_get_piece(id token, size_t & size) const {
+        const uint32_t offs = cache_piece_offs.at(token);
+        size = cache_piece_offs[token + 1] - offs - 1;
+        return cache_piece_data.data() + offs;
+    }
+
     void init_tokenizer();
 };
 
@@ -140,6 +157,18 @@ int32_t llama_tokenize_impl(
                             bool   add_special,
                             bool   parse_special);
 
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+               const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
 // does not write null-terminator to buf
 int32_t llama_token_to_piece_impl(
         const struct llama_vocab & vocab,
@@ -68,6 +68,7 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <future>
@@ -1783,6 +1784,48 @@ public:
         } ;
     }
 
+    // read len bytes at the given offset, can be called concurrently from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
+    // reads are not direct, see the POSIX implementation
+    size_t read_alignment() const {
+        return 1;
+    }
+
+    size_t read_window_size(size_t len, size_t offset) const {
+        GGML_UNUSED(offset);
+        return len;
+    }
+
+    const uint8_t * read_raw_at_window(void * buf, size_t len, size_t offset) const {
+        read_raw_at(buf, len, offset);
+        return (const uint8_t *) buf;
+    }
+
+    bool open_direct(const char * fname) {
+        // not supported, reads go through the page cache
+        GGML_UNUSED(fname);
+        return false;
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -1870,6 +1913,90 @@ public:
         }
     }
 
+    // read len bytes at the given offset, can be called concurrently from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+#if defined(_POSIX_VERSION)
+        if (fd_direct != -1) {
+            read_raw_at_direct(ptr, len, offset);
+        } else {
+            pread_full(fileno(fp), ptr, len, offset);
+        }
+#else
+        std::lock_guard<std::mutex> lock(read_mutex);
+        seek(offset, SEEK_SET);
+        read_raw(ptr, len);
+#endif
+    }
+
+#if defined(_POSIX_VERSION)
+    // alignment of the buffers and of the windows read by read_raw_at_window
+    size_t read_alignment() const {
+        return fd_direct != -1 ? DIRECT_IO_ALIGNMENT : 1;
+    }
+
+    // size of the buffer needed by read_raw_at_window
+    size_t read_window_size(size_t len, size_t offset) const {
+        const size_t align = read_alignment();
+        return (offset % align + len + align - 1) / align * align;
+    }
+
+    // read len bytes at the given offset to buf + offset % read_alignment(), where buf is aligned to read_alignment()
+    // and has room for read_window_size(len, offset) bytes, so that direct I/O reads the whole window in place
+    // returns a pointer to the data in buf, can be called concurrently from multiple threads
+    const uint8_t * read_raw_at_window(void * buf, size_t len, size_t offset) const {
+        if (fd_direct == -1) {
+            pread_full(fileno(fp), buf, len, offset);
+            return (const uint8_t *) buf;
+        }
+        GGML_ASSERT((uintptr_t) buf % DIRECT_IO_ALIGNMENT == 0);
+        const size_t skip = offset % DIRECT_IO_ALIGNMENT;
+        pread_direct(buf, read_window_size(len, offset), skip + len, offset - skip);
+        return (const uint8_t *) buf + skip;
+    }
+#else
+    size_t read_alignment() const {
+        return 1;
+    }
+
+    size_t read_window_size(size_t len, size_t offset) const {
+        GGML_UNUSED(offset);
+        return len;
+    }
+
+    const uint8_t * read_raw_at_window(void * buf, size_t len, size_t offset) const {
+        read_raw_at(buf, len, offset);
+        return (const uint8_t *) buf;
+    }
+#endif
+
+    // open the file a second time with O_DIRECT, so that read_raw_at bypasses the page cache
+    // returns false if direct I/O is not supported by the platform or the file system
+    bool open_direct(const char * fname) {
+#if defined(_POSIX_VERSION) && defined(O_DIRECT)
+        int fd = open(fname, O_RDONLY | O_DIRECT);
+        if (fd == -1) {
+            return false;
+        }
+        // some file systems accept O_DIRECT on open but fail the reads, check with a small read
+        void * buf = nullptr;
+        if (posix_memalign(&buf, DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT) != 0) {
+            close(fd);
+            return false;
+        }
+        ssize_t ret = pread(fd, buf, DIRECT_IO_ALIGNMENT, 0);
+        free(buf);
+        if (ret < 0) {
+            close(fd);
+            return false;
+        }
+        fd_direct = fd;
+        return true;
+#else
+        GGML_UNUSED(fname);
+        return false;
+#endif
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1895,7 +2022,102 @@ public:
         if (fp) {
             std::fclose(fp);
         }
+#if defined(_POSIX_VERSION)
+        if (fd_direct != -1) {
+            close(fd_direct);
+        }
+#endif
+    }
+
+private:
+#if defined(_POSIX_VERSION)
+    // offsets, sizes and buffers of O_DIRECT reads must be aligned to the logical block size of the device
+    static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+    static constexpr size_t DIRECT_IO_CHUNK     = 4*1024*1024;
+
+    int fd_direct = -1;
+
+    static void pread_full(int fd, void * ptr, size_t len, size_t offset) {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
+    // reads the n_read bytes of an aligned window, which may end past the end of the file
+    // fails if fewer than n_min bytes could be read
+    void pread_direct(void * buf, size_t n_read, size_t n_min, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < n_min) {
+            ssize_t ret = pread(fd_direct, (char *) buf + bytes_read, n_read - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
+    // O_DIRECT reads are done in aligned chunks through a bounce buffer, except where the destination has the same
+    // alignment as the offset: there only the unaligned head and tail go through the bounce buffer
+    // prefer read_raw_at_window when the caller can consume the data in place
+    void read_raw_at_direct(void * ptr, size_t len, size_t offset) const {
+        uint8_t * dst = (uint8_t *) ptr;
+
+        std::unique_ptr<void, decltype(&free)> bounce(nullptr, &free);
+        while (len > 0) {
+            if (offset % DIRECT_IO_ALIGNMENT == 0 && (uintptr_t) dst % DIRECT_IO_ALIGNMENT == 0 && len >= DIRECT_IO_ALIGNMENT) {
+                // read straight into the destination
+                const size_t n = std::min(len - len % DIRECT_IO_ALIGNMENT, DIRECT_IO_CHUNK);
+                pread_full(fd_direct, dst, n, offset);
+                dst    += n;
+                offset += n;
+                len    -= n;
+                continue;
+            }
+
+            if (!bounce) {
+                void * buf = nullptr;
+                if (posix_memalign(&buf, DIRECT_IO_ALIGNMENT, DIRECT_IO_CHUNK) != 0) {
+                    throw std::runtime_error("failed to allocate buffer for direct I/O");
+                }
+                bounce.reset(buf);
+            }
+
+            const size_t aligned_offset = offset - offset % DIRECT_IO_ALIGNMENT;
+            const size_t skip = offset - aligned_offset;
+            size_t n = std::min(len, DIRECT_IO_CHUNK - skip);
+            if ((uintptr_t) dst % DIRECT_IO_ALIGNMENT == skip) {
+                // only the head up to the next aligned offset, the rest is read straight into the destination
+                n = std::min(n, DIRECT_IO_ALIGNMENT - skip);
+            }
+
+            const size_t n_read = std::min(DIRECT_IO_CHUNK, (skip + n + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT);
+            pread_direct(bounce.get(), n_read, skip + n, aligned_offset);
+            memcpy(dst, (const uint8_t *) bounce.get() + skip, n);
+            dst    += n;
+            offset += n;
+            len    -= n;
+        }
     }
+#else
+    mutable std::mutex read_mutex;
+#endif
 #endif
 };
 using llama_files = std::vector<std::unique_ptr<llama_file>>;
@@ -1912,6 +2134,16 @@ struct llama_mmap {
     // list of mapped fragments (first_offset, last_offset)
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
+    // the advice used by release(), MADV_COLD falls back to MADV_DONTNEED on kernels that do not support it
+#if defined(MADV_COLD)
+    mutable int release_advice = MADV_COLD;
+#elif defined(MADV_DONTNEED)
+    mutable int release_advice = MADV_DONTNEED;
+#else
+    mutable int release_advice = POSIX_MADV_DONTNEED;
+#endif
+    mutable bool release_failed = false;
+
     llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false) {
         size = file->size;
         int fd = fileno(file->fp);
@@ -2011,6 +2243,40 @@ struct llama_mmap {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    // advise the kernel to start reading the range [first, last) of the file
+    void prefetch(size_t first, size_t last) const {
+        int page_size = sysconf(_SC_PAGESIZE);
+        first = first & ~(size_t) (page_size - 1);
+        if (last <= first) {
+            return;
+        }
+        if (posix_madvise((uint8_t *) addr + first, last - first, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
+    // advise the kernel that the range [first, last) of the file is not needed for now
+    // the pages are read again from the file on the next access
+    void release(size_t first, size_t last) const {
+        int page_size = sysconf(_SC_PAGESIZE);
+        align_range(&first, &last, page_size);
+        if (last <= first || release_failed) {
+            return;
+        }
+        int ret = madvise((uint8_t *) addr + first, last - first, release_advice);
+#if defined(MADV_COLD) && defined(MADV_DONTNEED)
+        if (ret && errno == EINVAL && release_advice == MADV_COLD) {
+            release_advice = MADV_DONTNEED;
+            ret = madvise((uint8_t *) addr + first, last - first, release_advice);
+        }
+#endif
+        if (ret) {
+            // warn once, the next calls would fail the same way
+            LLAMA_LOG_WARN("warning: madvise(.., %d) failed: %s, the pages of the model will not be released\n", release_advice, strerror(errno));
+            release_failed = true;
+        }
+    }
+
     ~llama_mmap() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -2074,6 +2340,18 @@ struct llama_mmap {
         GGML_UNUSED(last);
     }
 
+    void prefetch(size_t first, size_t last) const {
+        // not supported
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
+    void release(size_t first, size_t last) const {
+        // not supported
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
     ~llama_mmap() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -2097,6 +2375,16 @@ struct llama_mmap {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
+    void release(size_t first, size_t last) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
 #endif
 };
 using llama_mmaps = std::vector<std::unique_ptr<llama_mmap>>;
@@ -2786,13 +3074,20 @@ struct llama_kv_cache {
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
     // computed before each graph build
-    uint32_t n = 0;
+    // the ubatch attends to the cells [n0, n0 + n)
+    uint32_t n  = 0;
+    uint32_t n0 = 0;
 
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
     std::vector<llama_kv_cell> cells;
 
+    // the cells [first, last) that span the cells of each sequence, from which the window of a ubatch is computed
+    // extended when cells are allocated, and computed again from the cells after sequences are removed, copied or moved
+    std::unordered_map<llama_seq_id, std::pair<uint32_t, uint32_t>> seq_cells;
+    bool seq_cells_valid = true;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -2916,6 +3211,19 @@ struct llama_model {
     // model memory mapped files
     llama_mmaps mappings;
 
+    // number of layers prefetched ahead of the layer being evaluated when streaming mmap'd weights, 0 = disabled
+    int32_t n_prefetch_layers = 0;
+
+    // range of a memory mapped file used by the weights of a layer
+    struct layer_mmap_range {
+        const llama_mmap * mapping;
+        size_t first;
+        size_t last;
+    };
+
+    // per layer list of mmap'd weight ranges, used when streaming weights
+    std::vector<std::vector<layer_mmap_range>> layer_mmap_ranges;
+
     // objects representing data potentially being locked in memory
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
@@ -3010,11 +3318,13 @@ struct llama_sbatch {
         GGML_ASSERT(length <= seq.length);
         // Can only add sequences of equal lengths to a batch,
         // otherwise it isn't clear to which sequence a token belongs
-        GGML_ASSERT(seq.n_seq_id == 0 || ubatch.n_seqs == 0 || length == (size_t) ubatch.n_tokens / ubatch.n_seqs);
-        GGML_ASSERT((seq.n_seq_id != 0) == ubatch.equal_seqs);
+        GGML_ASSERT(!ubatch.equal_seqs || ubatch.n_seqs == 0 || length == (size_t) ubatch.n_tokens / ubatch.n_seqs);
+        GGML_ASSERT(seq.n_seq_id != 0 || !ubatch.equal_seqs);
+        // simple splits point into the batch, the others copy the tokens in the order of ids
+        const bool simple = seq.n_seq_id == 0;
         // NOTE: loops are separated for cache-friendliness
         if (batch->token) {
-            if (ubatch.equal_seqs) {
+            if (!simple) {
                 for (size_t i = 0; i < length; ++i) {
                     ubatch.token[ubatch.n_tokens + i] = batch->token[ids[seq.offset + i]];
                 }
@@ -3026,7 +3336,7 @@ struct llama_sbatch {
             ubatch.token = nullptr;
         }
         if (batch->embd) {
-            if (ubatch.equal_seqs) {
+            if (!simple) {
                 for (size_t i = 0; i < length; ++i) {
                     memcpy(
                         ubatch.embd + n_embd * (ubatch.n_tokens + i),
@@ -3041,7 +3351,7 @@ struct llama_sbatch {
         } else {
             ubatch.embd = nullptr;
         }
-        if (ubatch.equal_seqs) {
+        if (!simple) {
             for (size_t i = 0; i < length; ++i) {
                 ubatch.pos[ubatch.n_tokens + i] = batch->pos[ids[seq.offset + i]];
             }
@@ -3054,6 +3364,12 @@ struct llama_sbatch {
             if (seq.seq_id) {
                 ubatch.seq_id[ubatch.n_seqs] = seq.seq_id;
             }
+        } else if (!simple) {
+            // packed split, one virtual sequence per token
+            for (size_t i = 0; i < length; ++i) {
+                ubatch.n_seq_id[ubatch.n_seqs + i] = seq.n_seq_id;
+                ubatch.seq_id[ubatch.n_seqs + i] = seq.seq_id;
+            }
         } else {
             // simple split
             if (batch->n_seq_id) {
@@ -3073,7 +3389,7 @@ struct llama_sbatch {
                 out_ids.push_back(ids[seq.offset + i]);
             }
         } else if (batch->logits) {
-            if (ubatch.equal_seqs) {
+            if (!simple) {
                 for (size_t i = 0; i < length; ++i) {
                     size_t id = ids[seq.offset + i];
                     int8_t is_output = batch->logits[id];
@@ -3121,6 +3437,26 @@ struct llama_sbatch {
         return ubatch;
     }
 
+    // split of unequal-length sequences that keeps the tokens of each sequence together,
+    // so that each ubatch attends to as few sequences (and KV cells) as possible.
+    // shared prompts first, then the shortest sequences: the single-token sequences of a mixed batch
+    // end up in the same ubatch and each prompt is spread over consecutive ubatches
+    llama_ubatch split_packed(size_t n_ubatch) {
+        n_ubatch = n_tokens < n_ubatch ? n_tokens : n_ubatch;
+        llama_ubatch ubatch = reserve_ubatch(n_ubatch, /* has_embd */ batch->embd != nullptr);
+        ubatch.equal_seqs = false;
+        // starting from the end to pop in constant time
+        for (size_t i = seq.size(); i-- > 0 && ubatch.n_tokens < n_ubatch;) {
+            llama_sbatch_seq & s = seq[i];
+            GGML_ASSERT(s.n_seq_id > 0); // should not be mixed with simple splits
+            // the sequences drained by the previous splits have been popped by reserve_ubatch
+            GGML_ASSERT(s.length > 0);
+            const size_t length = std::min(s.length, n_ubatch - ubatch.n_tokens);
+            add_seq_to_ubatch(ubatch, s, length);
+        }
+        return ubatch;
+    }
+
     // make batches of equal-length sequences
     llama_ubatch split_equal(size_t n_ubatch) {
         n_ubatch = n_tokens < n_ubatch ? n_tokens : n_ubatch;
@@ -3329,6 +3665,9 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    // whether the user eval callback asked for the node that the prefetch eval callback is called for next
+    bool cb_eval_user_need = false;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -3512,7 +3851,8 @@ static bool llama_kv_cache_init(
     cache.has_shift = false;
 
     cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+    // note: a quantized V cache cannot be transposed, so it is kept in rows and KQV is computed with ggml_out_prod
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn && !ggml_is_quantized(type_v);
 
     cache.head = 0;
     cache.size = kv_size;
@@ -3585,6 +3925,33 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// extend the cells of a sequence with [i0, i1)
+static void llama_kv_cache_seq_cells_add(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t i0, uint32_t i1) {
+    auto it = cache.seq_cells.find(seq_id);
+    if (it == cache.seq_cells.end()) {
+        cache.seq_cells.emplace(seq_id, std::make_pair(i0, i1));
+    } else {
+        it->second.first  = std::min(it->second.first,  i0);
+        it->second.second = std::max(it->second.second, i1);
+    }
+}
+
+// compute the cells of the sequences again if they were invalidated by a change other than an allocation
+static void llama_kv_cache_seq_cells_update(struct llama_kv_cache & cache) {
+    if (cache.seq_cells_valid) {
+        return;
+    }
+
+    cache.seq_cells.clear();
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+            llama_kv_cache_seq_cells_add(cache, seq_id, i, i + 1);
+        }
+    }
+
+    cache.seq_cells_valid = true;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -3604,6 +3971,8 @@ static bool llama_kv_cache_find_slot(
         // can only process batches with an equal number of new tokens in each sequence
         GGML_ASSERT(batch.equal_seqs);
 
+        cache.seq_cells_valid = false;
+
         int32_t min = cache.size - 1;
         int32_t max = 0;
 
@@ -3801,6 +4170,10 @@ static bool llama_kv_cache_find_slot(
                 cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
             }
         }
+
+        for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+            llama_kv_cache_seq_cells_add(cache, batch.seq_id[s][j], cache.head + s*n_seq_tokens, cache.head + (s + 1)*n_seq_tokens);
+        }
     }
 
     cache.used += n_tokens;
@@ -3821,7 +4194,36 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+// the cells that the tokens of the ubatch can attend to are the ones of their sequences
+// the others are masked, so restricting the attention to the range that spans the former shrinks the KQ matrix when
+// the sequences of the ubatch occupy a small part of the cache
+static void llama_kv_cache_set_window(struct llama_kv_cache & cache, const llama_ubatch & ubatch, uint32_t pad) {
+    llama_kv_cache_seq_cells_update(cache);
+
+    uint32_t i0 = cache.size;
+    uint32_t i1 = 0;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            // the cells of the ubatch have been allocated already
+            const auto it = cache.seq_cells.find(ubatch.seq_id[s][j]);
+            GGML_ASSERT(it != cache.seq_cells.end());
+
+            i0 = std::min(i0, it->second.first);
+            i1 = std::max(i1, it->second.second);
+        }
+    }
+
+    GGML_ASSERT(i0 < i1);
+
+    cache.n0 = i0 - i0 % pad;
+    cache.n  = std::min(cache.size - cache.n0, std::max(pad, GGML_PAD(i1 - cache.n0, pad)));
+}
+
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
+    cache.seq_cells.clear();
+    cache.seq_cells_valid = true;
+
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
         cache.cells[i].seq_id.clear();
@@ -3846,6 +4248,8 @@ static bool llama_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
+    cache.seq_cells_valid = false;
+
     // models like Mamba or RWKV can't have a state partially erased
     if (cache.recurrent) {
         if (seq_id >= (int64_t) cache.size) {
@@ -3908,6 +4312,8 @@ static void llama_kv_cache_seq_cp(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
+    cache.seq_cells_valid = false;
+
     if (cache.recurrent) {
         if ((uint32_t) seq_id_dst < cache.size && (uint32_t) seq_id_src < cache.size) {
             llama_kv_cell & tail_src = cache.cells[seq_id_src];
@@ -3949,6 +4355,8 @@ static void llama_kv_cache_seq_cp(
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
+    cache.seq_cells_valid = false;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.recurrent && (llama_seq_id) i != seq_id) {
             cache.cells[i].tail = -1;
@@ -4008,6 +4416,7 @@ static void llama_kv_cache_seq_add(
                 }
                 cache.cells[i].pos = -1;
                 cache.cells[i].seq_id.clear();
+                cache.seq_cells_valid = false;
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -4303,6 +4712,7 @@ struct llama_model_loader {
     bool check_tensors;
 
     llama_files files;
+    std::vector<std::string> file_paths;
     llama_ftype ftype;
     llama_fver  fver;
 
@@ -4334,7 +4744,7 @@ struct llama_model_loader {
     std::string arch_name;
     LLM_KV      llm_kv    = LLM_KV(LLM_ARCH_UNKNOWN);
 
-    llama_model_loader(const std::string & fname, bool use_mmap, bool check_tensors, const struct llama_model_kv_override * param_overrides_p) {
+    llama_model_loader(const std::string & fname, bool use_mmap, bool use_direct_io, bool check_tensors, const struct llama_model_kv_override * param_overrides_p) {
         int trace = 0;
         if (getenv("LLAMA_TRACE")) {
             trace = atoi(getenv("LLAMA_TRACE"));
@@ -4361,6 +4771,7 @@ struct llama_model_loader {
         llm_kv = LLM_KV(llm_arch_from_string(arch_name));
 
         files.emplace_back(new llama_file(fname.c_str(), "rb"));
+        file_paths.emplace_back(fname);
         contexts.emplace_back(ctx);
 
         // Save tensors data offset of the main file.
@@ -4403,6 +4814,7 @@ struct llama_model_loader {
                 }
 
                 files.emplace_back(new llama_file(split_path, "rb"));
+                file_paths.emplace_back(split_path);
                 contexts.emplace_back(ctx);
 
                 // Save tensors data offset info of the shard.
@@ -4554,6 +4966,16 @@ struct llama_model_loader {
 
         this->use_mmap = use_mmap;
         this->check_tensors = check_tensors;
+
+        if (use_direct_io && !use_mmap) {
+            for (size_t i = 0; i < files.size(); i++) {
+                if (!files[i]->open_direct(file_paths[i].c_str())) {
+                    LLAMA_LOG_WARN("%s: direct I/O is not supported for %s, using buffered reads\n", __func__, file_paths[i].c_str());
+                }
+            }
+        } else if (use_direct_io) {
+            LLAMA_LOG_WARN("%s: direct I/O is only used when mmap is disabled\n", __func__);
+        }
     }
 
     ~llama_model_loader() {
@@ -4950,7 +5372,6 @@ struct llama_model_loader {
             void * progress_callback_user_data) {
         GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
-        std::vector<no_init<uint8_t>> read_buf;
         std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
         // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
@@ -5003,9 +5424,15 @@ struct llama_model_loader {
                 return nullptr;
             }
 
+            // with direct I/O, the buffers have room for the aligned window around each chunk, see read_raw_at_window
+            size_t read_align = 1;
+            for (const auto & file : files) {
+                read_align = std::max(read_align, file->read_alignment());
+            }
+
             // If the backend is supported, create pinned memory buffers and events for synchronisation.
             for (size_t idx = 0; idx < n_buffers; ++idx) {
-                auto * buf = ggml_backend_buft_alloc_buffer(host_buft, buffer_size);
+                auto * buf = ggml_backend_buft_alloc_buffer(host_buft, buffer_size + 3*(read_align - 1));
                 if (!buf) {
                     LLAMA_LOG_DEBUG("%s: failed to allocate host buffer for async uploads for device %s\n", fn,
                         ggml_backend_dev_name(dev));
@@ -5013,7 +5440,7 @@ struct llama_model_loader {
                 }
 
                 host_buffers.emplace_back(buf);
-                host_ptrs.emplace_back(ggml_backend_buffer_get_base(buf));
+                host_ptrs.emplace_back((void *) GGML_PAD((uintptr_t) ggml_backend_buffer_get_base(buf), read_align));
 
                 auto * event = ggml_backend_event_new(dev);
                 if (!event) {
@@ -5042,6 +5469,45 @@ struct llama_model_loader {
                 ggml_backend_name(upload_backend));
         }
 
+        // without mmap and async uploads, tensors are read with positional reads on several threads
+        // the reads are completed in order, so that progress reporting and uploads to non-host buffers
+        // happen on this thread while the next tensors are being read
+        struct pending_read {
+            ggml_tensor * tensor;
+            std::vector<no_init<uint8_t>> staging; // only used for tensors in non-host buffers
+            const uint8_t * data = nullptr;        // the tensor data in staging
+            std::future<void> done;
+        };
+        std::deque<pending_read> pending_reads;
+        size_t pending_bytes = 0;
+
+        const size_t max_pending_reads = std::min<size_t>(8, std::max<size_t>(1, std::thread::hardware_concurrency()));
+        constexpr size_t max_pending_bytes = 512 * 1024 * 1024; // limits the memory used by the staging buffers
+
+        auto finish_read = [&]() {
+            pending_read & pr = pending_reads.front();
+            pr.done.get();
+
+            ggml_tensor * cur = pr.tensor;
+            const size_t n_size = ggml_nbytes(cur);
+            if (pr.staging.empty()) {
+                if (check_tensors) {
+                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
+                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
+                    }));
+                }
+            } else {
+                ggml_backend_tensor_set(cur, pr.data, 0, n_size);
+                if (check_tensors && !ggml_validate_row_data(cur->type, pr.data, n_size)) {
+                    throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+                }
+                pending_bytes -= pr.staging.size();
+            }
+
+            size_done += n_size;
+            pending_reads.pop_front();
+        };
+
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
@@ -5088,41 +5554,55 @@ struct llama_model_loader {
             } else {
                 GGML_ASSERT(weight->idx < files.size());
                 const auto & file = files.at(weight->idx);
-                if (ggml_backend_buffer_is_host(cur->buffer)) {
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(cur->data, n_size);
-                    if (check_tensors) {
-                        validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                            return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                        }));
+                if (!upload_backend || ggml_backend_buffer_is_host(cur->buffer)) {
+                    const bool is_host = ggml_backend_buffer_is_host(cur->buffer);
+
+                    while (!pending_reads.empty() && (pending_reads.size() >= max_pending_reads ||
+                           (!is_host && pending_bytes + n_size > max_pending_bytes))) {
+                        finish_read();
                     }
-                } else {
-                    // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                    if (upload_backend) {
-                        file->seek(weight->offs, SEEK_SET);
 
-                        size_t bytes_read = 0;
+                    pending_reads.emplace_back();
+                    pending_read & pr = pending_reads.back();
+                    pr.tensor = cur;
+                    const llama_file * f = file.get();
+                    const size_t offs = weight->offs;
+                    if (is_host) {
+                        // with direct I/O, the tensor is read in place only where its address has the same alignment as
+                        // its offset in the file, the rest is copied once from an aligned buffer, like the page cache does
+                        void * dst = cur->data;
+                        pr.done = std::async(std::launch::async, [f, dst, n_size, offs] {
+                            f->read_raw_at(dst, n_size, offs);
+                        });
+                    } else {
+                        // read the aligned window around the tensor, so that direct I/O does not need a bounce buffer
+                        const size_t align = f->read_alignment();
+                        pr.staging.resize(f->read_window_size(n_size, offs) + align - 1);
+                        pending_bytes += pr.staging.size();
+                        uint8_t * buf = (uint8_t *) GGML_PAD((uintptr_t) pr.staging.data(), align);
+                        pr.data = buf + offs % align;
+                        pr.done = std::async(std::launch::async, [f, buf, n_size, offs] {
+                            f->read_raw_at_window(buf, n_size, offs);
+                        });
+                    }
 
-                        while (bytes_read < n_size) {
-                            size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+                    // size_done is updated when the read is finished
+                    continue;
+                } else {
+                    // upload_backend is valid: load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+                    size_t bytes_read = 0;
 
-                            ggml_backend_event_synchronize(events[buffer_idx]);
-                            file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                            ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                            ggml_backend_event_record(events[buffer_idx], upload_backend);
+                    while (bytes_read < n_size) {
+                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
 
-                            bytes_read += read_iteration;
-                            ++buffer_idx;
-                            buffer_idx %= n_buffers;
-                        }
-                    } else {
-                        read_buf.resize(n_size);
-                        file->seek(weight->offs, SEEK_SET);
-                        file->read_raw(read_buf.data(), n_size);
-                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                        if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                            throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
-                        }
+                        ggml_backend_event_synchronize(events[buffer_idx]);
+                        const uint8_t * data = file->read_raw_at_window(host_ptrs[buffer_idx], read_iteration, weight->offs + bytes_read);
+                        ggml_backend_tensor_set_async(upload_backend, cur, data, bytes_read, read_iteration);
+                        ggml_backend_event_record(events[buffer_idx], upload_backend);
+
+                        bytes_read += read_iteration;
+                        ++buffer_idx;
+                        buffer_idx %= n_buffers;
                     }
                 }
             }
@@ -5130,6 +5610,10 @@ struct llama_model_loader {
             size_done += n_size;
         }
 
+        while (!pending_reads.empty()) {
+            finish_read();
+        }
+
         // free temporary resources used for async uploads
         for (auto * event : events) {
             ggml_backend_event_synchronize(event);
@@ -6784,19 +7268,22 @@ static void llm_load_vocab(
 
     // build token to piece cache
     {
-        size_t size_cache = 0;
-
-        std::vector<llama_vocab::token> cache_token_to_piece(n_vocab);
+        std::vector<char>     cache_piece_data;
+        std::vector<uint32_t> cache_piece_offs(n_vocab + 1);
 
         for (uint32_t id = 0; id < n_vocab; ++id) {
-            cache_token_to_piece[id] = llama_token_to_piece(&model, id, true);
+            const std::string piece = llama_token_to_piece(&model, id, true);
 
-            size_cache += cache_token_to_piece[id].size();
+            cache_piece_offs[id] = cache_piece_data.size();
+            cache_piece_data.insert(cache_piece_data.end(), piece.begin(), piece.end());
+            cache_piece_data.push_back(0);
         }
+        cache_piece_offs[n_vocab] = cache_piece_data.size();
 
-        std::swap(vocab.cache_token_to_piece, cache_token_to_piece);
+        std::swap(vocab.cache_piece_data, cache_piece_data);
+        std::swap(vocab.cache_piece_offs, cache_piece_offs);
 
-        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, vocab.cache_piece_data.size() / 1024.0 / 1024.0);
     }
 
     // Handle per token attributes
@@ -8956,7 +9443,8 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
+    // when streaming weights, the pages are read on demand as the layers are evaluated
+    ml.init_mappings(model.n_prefetch_layers == 0, use_mlock ? &model.mlock_mmaps : nullptr);
     model.mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -9075,6 +9563,41 @@ static bool llm_load_tensors(
         }
     }
 
+    if (model.n_prefetch_layers > 0) {
+        // collect the ranges of the mapped files used by the weights of each layer
+        model.layer_mmap_ranges.resize(hparams.n_layer);
+        for (const auto & it : model.tensors_by_name) {
+            int il = -1;
+            if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= (int) hparams.n_layer) {
+                continue;
+            }
+            const uint8_t * data = (const uint8_t *) it.second->data;
+            for (const auto & mapping : model.mappings) {
+                const uint8_t * addr = (const uint8_t *) mapping->addr;
+                if (data < addr || data >= addr + mapping->size) {
+                    continue;
+                }
+                const size_t first = data - addr;
+                const size_t last  = first + ggml_nbytes(it.second);
+
+                auto & ranges = model.layer_mmap_ranges[il];
+                auto range = std::find_if(ranges.begin(), ranges.end(), [&](const llama_model::layer_mmap_range & r) {
+                    return r.mapping == mapping.get();
+                });
+                if (range == ranges.end()) {
+                    ranges.push_back({mapping.get(), first, last});
+                } else {
+                    range->first = std::min(range->first, first);
+                    range->last  = std::max(range->last,  last);
+                }
+            }
+        }
+        if (model.mappings.empty()) {
+            LLAMA_LOG_WARN("%s: weights are not memory mapped, layer prefetching is disabled\n", __func__);
+            model.layer_mmap_ranges.clear();
+        }
+    }
+
     return true;
 }
 
@@ -9083,9 +9606,10 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
     model.t_start_us = ggml_time_us();
 
     try {
-        llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
+        llama_model_loader ml(fname, params.use_mmap, params.use_direct_io, params.check_tensors, params.kv_overrides);
 
         model.hparams.vocab_only = params.vocab_only;
+        model.n_prefetch_layers  = params.use_mmap ? std::max(0, params.n_prefetch_layers) : 0;
 
         try {
             llm_load_arch(ml, model);
@@ -9236,7 +9760,7 @@ static void llm_build_kv_store(
 
     struct ggml_tensor * v_cache_view = nullptr;
 
-    if (cparams.flash_attn) {
+    if (!kv.v_trans) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*kv_head);
     } else {
         // note: the V cache is transposed when not using flash attention
@@ -9592,12 +10116,15 @@ static struct ggml_tensor * llm_build_kqv(
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
 
+    // the cells [kv.n0, kv.n0 + n_kv)
+    const int64_t n0 = kv.n0;
+
     struct ggml_tensor * k =
         ggml_view_3d(ctx, kv.k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
                 ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
                 ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
-                0);
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*n0);
     cb(k, "k", il);
 
     struct ggml_tensor * cur;
@@ -9612,7 +10139,7 @@ static struct ggml_tensor * llm_build_kqv(
                     n_embd_head_v, n_kv, n_head_kv,
                     ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
                     ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
-                    0);
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*n0);
         cb(v, "v", il);
 
         cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
@@ -9658,16 +10185,32 @@ static struct ggml_tensor * llm_build_kqv(
 
         GGML_ASSERT(kv.size == n_ctx);
 
-        // split cached v into n_head heads
-        struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
-                    n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
-                    0);
-        cb(v, "v", il);
+        struct ggml_tensor * kqv = nullptr;
+
+        if (kv.v_trans) {
+            // split cached v into n_head heads
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[il],
+                        n_kv, n_embd_head_v, n_head_kv,
+                        ggml_element_size(kv.v_l[il])*n_ctx,
+                        ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                        ggml_element_size(kv.v_l[il])*n0);
+            cb(v, "v", il);
+
+            kqv = ggml_mul_mat(ctx, v, kq);
+        } else {
+            // split cached v into n_head heads (not transposed, e.g. quantized V cache)
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[il],
+                        n_embd_head_v, n_kv, n_head_kv,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*n0);
+            cb(v, "v", il);
 
-        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+            // kqv[:, t, h] = sum_i v[:, i, h/n_gqa] * kq[i, t, h] - the rows of v are dequantized once per kv head
+            kqv = ggml_out_prod(ctx, v, ggml_transpose(ctx, kq));
+        }
         cb(kqv, "kqv", il);
 
         struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
@@ -10273,8 +10816,8 @@ struct llm_build_context {
                 ggml_tensor * view_v_src;
                 ggml_tensor * view_v_dst;
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
+                if (!kv_self.v_trans) {
+                    // NOTE: the V cache is not transposed when using flash attention or a quantized V cache
                     view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
                             n_embd_v_gqa, nm,
                             ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
@@ -15381,7 +15924,7 @@ struct llm_build_context {
                             n_embd_head_k, n_kv, n_head_kv,
                             ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
                             ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            0);
+                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa)*kv_self.n0);
                 cb(k, "k", il);
 
                 struct ggml_tensor * v =
@@ -15389,7 +15932,7 @@ struct llm_build_context {
                             n_kv, n_embd_head_v, n_head_kv,
                             ggml_element_size(kv_self.v_l[il])*n_ctx,
                             ggml_element_size(kv_self.v_l[il])*n_ctx*n_embd_head_v,
-                            0);
+                            ggml_element_size(kv_self.v_l[il])*kv_self.n0);
                 cb(v, "v", il);
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
@@ -16321,6 +16864,11 @@ static struct ggml_cgraph * llama_build_graph(
                   bool   worst_case) {
     const auto & model = lctx.model;
 
+    if (worst_case) {
+        // the worst case graph attends to the whole cache
+        lctx.kv_self.n0 = 0;
+    }
+
     // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
     llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -16672,6 +17220,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
             const int64_t n_kv         = kv_self.n;
+            const int64_t n0           = kv_self.n0;
             const int64_t n_tokens     = ubatch.n_tokens;
             const int64_t n_seq_tokens = ubatch.n_seq_tokens;
             const int64_t n_seqs       = ubatch.n_seqs;
@@ -16701,12 +17250,14 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
                         const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
 
                         for (int i = 0; i < n_kv; ++i) {
+                            const llama_kv_cell & cell = kv_self.cells[n0 + i];
+
                             float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                            if (!cell.has_seq_id(seq_id) || cell.pos > pos) {
                                 f = -INFINITY;
                             } else {
                                 if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
+                                    f = -std::abs(cell.pos - pos);
                                 } else {
                                     f = 0.0f;
                                 }
@@ -16718,7 +17269,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
 
                             // may need to cut off old tokens for sliding window
                             if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - cell.pos >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                                 data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
@@ -16953,7 +17504,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     for (int i = 0; i < n_kv; ++i) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[i].pos, ubatch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[kv_self.n0 + i].pos, ubatch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
                     }
                 }
             }
@@ -17112,23 +17663,82 @@ static void llama_output_reorder(struct llama_context * ctx) {
     }
 }
 
-static void llama_graph_compute(
-          llama_context & lctx,
-            ggml_cgraph * gf,
-                    int   n_threads,
-        ggml_threadpool * threadpool) {
-    if (lctx.backend_cpu != nullptr) {
-        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
-        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+static void llama_model_prefetch_layer(const llama_model & model, int il) {
+    if (il < 0 || il >= (int) model.layer_mmap_ranges.size()) {
+        return;
     }
-
-    // set the number of threads for all the backends
-    for (const auto & set_n_threads_fn : lctx.set_n_threads_fns) {
-        set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
+    for (const auto & range : model.layer_mmap_ranges[il]) {
+        range.mapping->prefetch(range.first, range.last);
     }
+}
 
-    auto err = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
-    if (err != GGML_STATUS_SUCCESS) {
+static void llama_model_release_layer(const llama_model & model, int il) {
+    if (il < 0 || il >= (int) model.layer_mmap_ranges.size()) {
+        return;
+    }
+    for (const auto & range : model.layer_mmap_ranges[il]) {
+        range.mapping->release(range.first, range.last);
+    }
+}
+
+// eval callback used when streaming mmap'd weights: when the output of a layer is computed, the layer
+// is released and the next layer that is not prefetched yet is prefetched; all nodes are also passed
+// to the user callback
+static bool llama_prefetch_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    llama_context & lctx = *(llama_context *) user_data;
+    const auto & cparams = lctx.cparams;
+
+    int il = -1;
+    if (strncmp(t->name, "l_out-", 6) == 0) {
+        il = atoi(t->name + 6);
+    }
+
+    if (ask) {
+        // the scheduler computes the node and calls back with ask == false before asking for the next one
+        lctx.cb_eval_user_need = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+        return lctx.cb_eval_user_need || il >= 0;
+    }
+
+    if (il >= 0) {
+        llama_model_release_layer(lctx.model, il);
+        llama_model_prefetch_layer(lctx.model, il + lctx.model.n_prefetch_layers);
+    }
+
+    return !lctx.cb_eval_user_need || cparams.cb_eval(t, false, cparams.cb_eval_user_data);
+}
+
+static void llama_set_eval_callback(llama_context & lctx) {
+    const auto & model = lctx.model;
+
+    if (model.layer_mmap_ranges.empty()) {
+        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        return;
+    }
+
+    // start reading the first layers while the graph is being built
+    for (int il = 0; il < model.n_prefetch_layers; ++il) {
+        llama_model_prefetch_layer(model, il);
+    }
+    ggml_backend_sched_set_eval_callback(lctx.sched, llama_prefetch_eval_callback, &lctx);
+}
+
+static void llama_graph_compute(
+          llama_context & lctx,
+            ggml_cgraph * gf,
+                    int   n_threads,
+        ggml_threadpool * threadpool) {
+    if (lctx.backend_cpu != nullptr) {
+        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
+        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+    }
+
+    // set the number of threads for all the backends
+    for (const auto & set_n_threads_fn : lctx.set_n_threads_fns) {
+        set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
+    }
+
+    auto err = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    if (err != GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, err);
     }
 
@@ -17192,6 +17802,9 @@ static int llama_decode_internal(
     uint32_t n_outputs = 0;
     uint32_t n_outputs_prev = 0;
 
+    // used cells of the cache, for the defragmentation heuristic
+    uint32_t n_kv_max = kv_self.n0 + kv_self.n;
+
     const auto n_ubatch = cparams.n_ubatch;
 
     // this indicates we are doing pooled embedding, so we ignore batch.logits and output all tokens
@@ -17211,8 +17824,25 @@ static int llama_decode_internal(
         n_outputs = 1;
     }
 
+    // when the batch is split in several ubatches, the tokens of each sequence are kept together (see split_packed)
+    bool split_packed = false;
+    if (!kv_self.recurrent && n_tokens_all > n_ubatch) {
+        for (uint32_t i = 1; i < n_tokens_all && !split_packed; ++i) {
+            if (batch.n_seq_id[i] != batch.n_seq_id[0]) {
+                split_packed = true;
+                break;
+            }
+            for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+                if (batch.seq_id[i][j] != batch.seq_id[0][j]) {
+                    split_packed = true;
+                    break;
+                }
+            }
+        }
+    }
+
     lctx.sbatch.from_batch(batch, n_embd,
-        /* simple_split */ !kv_self.recurrent,
+        /* simple_split */ !kv_self.recurrent && !split_packed,
         /* logits_all   */ n_outputs == n_tokens_all);
 
     // reserve output buffer
@@ -17232,6 +17862,8 @@ static int llama_decode_internal(
                 // with equal-length sequences
                 ubatch = lctx.sbatch.split_equal(n_ubatch);
             }
+        } else if (split_packed) {
+            ubatch = lctx.sbatch.split_packed(n_ubatch);
         } else {
             ubatch = lctx.sbatch.split_simple(n_ubatch);
         }
@@ -17278,15 +17910,21 @@ static int llama_decode_internal(
                 // after enough generations, the benefit from this heuristic disappears
                 // if we start defragmenting the cache, the benefit from this will be more important
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
-                kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
-                //kv_self.n = llama_kv_cache_cell_max(kv_self);
+                n_kv_max = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
+
+                if (cparams.causal_attn) {
+                    llama_kv_cache_set_window(kv_self, ubatch, pad);
+                } else {
+                    kv_self.n0 = 0;
+                    kv_self.n  = n_kv_max;
+                }
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
         ggml_backend_sched_reset(lctx.sched);
-        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        llama_set_eval_callback(lctx);
 
         ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
@@ -17436,7 +18074,7 @@ static int llama_decode_internal(
 
     // decide if we need to defrag the kv cache
     if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
-        const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
+        const float fragmentation = n_kv_max >= 128 ? 1.0f - float(kv_self.used)/float(n_kv_max) : 0.0f;
 
         // queue defragmentation for next llama_kv_cache_update
         if (fragmentation > cparams.defrag_thold) {
@@ -17527,7 +18165,7 @@ static int llama_encode_internal(
     GGML_ASSERT(n_threads > 0);
 
     ggml_backend_sched_reset(lctx.sched);
-    ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+    llama_set_eval_callback(lctx);
 
     ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
@@ -17733,6 +18371,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
             // move the cell meta data
             kv_self.cells[i0 + nf] = cell1;
+            kv_self.seq_cells_valid = false;
 
             // clear the old cell and move the head there
             cell1 = llama_kv_cell();
@@ -18428,7 +19067,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         auto v = (std::vector<llama_model_kv_override>*)params->kv_overrides;
         kv_overrides = v->data();
     }
-    llama_model_loader ml(fname_inp, use_mmap, /*check_tensors*/ true, kv_overrides);
+    llama_model_loader ml(fname_inp, use_mmap, /*use_direct_io*/ false, /*check_tensors*/ true, kv_overrides);
     ml.init_mappings(false); // no prefetching
 
     llama_model model;
@@ -19015,6 +19654,8 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_direct_io               =*/ false,
+        /*.n_prefetch_layers           =*/ 0,
     };
 
 #ifdef GGML_USE_METAL
@@ -19288,8 +19929,10 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
-    if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+    // without flash_attn, a quantized V cache is only supported when it stays on the CPU
+    if (ggml_is_quantized(params.type_v) && !params.flash_attn &&
+        params.offload_kqv && !model->devices.empty() && model->n_gpu_layers > 0) {
+        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn when the KV cache is offloaded\n", __func__);
         return nullptr;
     }
 
@@ -20122,12 +20765,79 @@ bool llama_save_session_file(struct llama_context * ctx, const char * path_sessi
 }
 
 // TODO: replace all non-fatal assertions with returned errors or exceptions
+// the KV data blocks of session files start at offsets that are a multiple of this
+// so that they can be copied to and from the tensors directly from a mapping of the file
+#define LLAMA_STATE_FILE_ALIGNMENT 4096
+
+// compressed sequence state (LLAMA_STATE_SEQ_FLAGS_COMPRESS)
+// the K/V rows are stored as Q8_0 and converted to the type of the destination cache when loading
+
+static ggml_type llama_state_compressed_type(ggml_type type, int64_t n_per_row, bool recurrent) {
+    // the recurrent states are kept as they are
+    if (recurrent || n_per_row % ggml_blck_size(GGML_TYPE_Q8_0) != 0) {
+        return type;
+    }
+    if (ggml_row_size(type, n_per_row) <= ggml_row_size(GGML_TYPE_Q8_0, n_per_row)) {
+        return type;
+    }
+    return GGML_TYPE_Q8_0;
+}
+
+static bool llama_state_rows_to_f32(ggml_type type, const void * src, float * dst, int64_t n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+        return true;
+    }
+    const auto * traits = ggml_get_type_traits(type);
+    if (traits->to_float == nullptr) {
+        LLAMA_LOG_ERROR("%s: cannot convert kv cache data of type %s\n", __func__, ggml_type_name(type));
+        return false;
+    }
+    traits->to_float(src, dst, n);
+    return true;
+}
+
+static bool llama_state_rows_from_f32(ggml_type type, const float * src, void * dst, int64_t nrows, int64_t n_per_row) {
+    if (ggml_quantize_requires_imatrix(type) || n_per_row % ggml_blck_size(type) != 0) {
+        LLAMA_LOG_ERROR("%s: cannot convert kv cache data to type %s\n", __func__, ggml_type_name(type));
+        return false;
+    }
+    ggml_quantize_chunk(type, src, dst, 0, nrows, n_per_row, nullptr);
+    return true;
+}
+
+static void llama_state_write_varint(std::vector<uint8_t> & buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((uint8_t) v);
+}
+
+static bool llama_state_read_varint(const uint8_t * & ptr, const uint8_t * end, uint64_t & v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && ptr < end; shift += 7) {
+        const uint8_t b = *ptr++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 struct llama_data_write {
     virtual void write(const void * src, size_t size) = 0;
     virtual void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) = 0;
     virtual size_t get_size_written() = 0;
     virtual ~llama_data_write() = default;
 
+    // pad to the alignment of the next tensor data block (files only)
+    virtual void align() {}
+
+    // only the size of the data is needed, its content is discarded
+    virtual bool size_only() const { return false; }
+
     void write_string(const std::string & str) {
         uint32_t str_size = str.size();
 
@@ -20246,6 +20956,8 @@ struct llama_data_write {
             const uint64_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
             write(&k_size_row, sizeof(k_size_row));
 
+            align();
+
             // Read each range of cells of k_size length each into tmp_buf and write out
             for (const auto & range : cell_ranges) {
                 const size_t range_size = range.second - range.first;
@@ -20266,6 +20978,8 @@ struct llama_data_write {
                 const uint64_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
                 write(&v_size_row, sizeof(v_size_row));
 
+                align();
+
                 // Read each range of cells of v_size length each into tmp_buf and write out
                 for (const auto & range : cell_ranges) {
                     const size_t range_size = range.second - range.first;
@@ -20290,6 +21004,8 @@ struct llama_data_write {
                 // Write GQA embedding size
                 write(&n_embd_v_gqa, sizeof(n_embd_v_gqa));
 
+                align();
+
                 // For each row, we get the element values of each cell
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                     // Read each range of cells of v_size_el length each into tmp_buf and write out
@@ -20304,17 +21020,14 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
-        std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
+    // find the ranges of cells with the specified seq_id (or all, when -1) and count them
+    static uint32_t get_kv_cache_cell_ranges(const llama_kv_cache & kv_self, llama_seq_id seq_id, llama_pos p0, std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         uint32_t cell_count = 0;
 
-        // Count the number of cells with the specified seq_id
-        // Find all the ranges of cells with this seq id (or all, when -1)
         uint32_t cell_range_begin = kv_self.size;
         for (uint32_t i = 0; i < kv_self.size; ++i) {
             const auto & cell = kv_self.cells[i];
-            if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+            if ((seq_id == -1 && !cell.is_empty()) || (cell.has_seq_id(seq_id) && (p0 < 0 || cell.pos >= p0))) {
                 ++cell_count;
                 if (cell_range_begin == kv_self.size) {
                     cell_range_begin = i;
@@ -20337,11 +21050,173 @@ struct llama_data_write {
         }
         GGML_ASSERT(cell_count == cell_count_check);
 
+        return cell_count;
+    }
+
+    // p0 >= 0: only the cells of seq_id at positions [p0, inf) (delta snapshot)
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1, llama_pos p0 = -1) {
+        const struct llama_kv_cache & kv_self = ctx->kv_self;
+        std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
+
+        // the state of recurrent models is not split by position
+        if (kv_self.recurrent) {
+            p0 = -1;
+        }
+
+        const uint32_t cell_count = get_kv_cache_cell_ranges(kv_self, seq_id, p0, cell_ranges);
+
         write(&cell_count, sizeof(cell_count));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
         write_kv_cache_data(ctx, cell_ranges);
     }
+
+    // the cells of a single sequence in compressed form:
+    //   - the positions are zigzag delta + varint encoded
+    //   - the K and V rows of each layer are stored one per cell, independent of the layout of V, in the type
+    //     returned by llama_state_compressed_type
+    //   - the header holds the shape of the rows, so that a state copied from another model is rejected before
+    //     the destination sequence is touched
+    void write_kv_cache_compressed(const struct llama_context * ctx, llama_seq_id seq_id) {
+        const struct llama_kv_cache & kv_self = ctx->kv_self;
+        const struct llama_hparams & hparams = ctx->model.hparams;
+
+        const uint32_t magic     = LLAMA_STATE_SEQ_COMPRESSED_MAGIC;
+        const uint32_t version   = LLAMA_STATE_SEQ_COMPRESSED_VERSION;
+        const uint32_t n_layer   = hparams.n_layer;
+        const uint32_t recurrent = kv_self.recurrent ? 1 : 0;
+
+        write(&magic,     sizeof(magic));
+        write(&version,   sizeof(version));
+        write(&n_layer,   sizeof(n_layer));
+        write(&recurrent, sizeof(recurrent));
+
+        for (uint32_t il = 0; il < n_layer; ++il) {
+            const uint32_t n_embd_k = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
+            const uint32_t n_embd_v = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+            write(&n_embd_k, sizeof(n_embd_k));
+            write(&n_embd_v, sizeof(n_embd_v));
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>> cell_ranges;
+
+        const uint32_t cell_count = get_kv_cache_cell_ranges(kv_self, seq_id, -1, cell_ranges);
+
+        write(&cell_count, sizeof(cell_count));
+
+        {
+            std::vector<uint8_t> pos_buf;
+
+            llama_pos pos_prev = -1;
+            for (const auto & range : cell_ranges) {
+                for (uint32_t i = range.first; i < range.second; ++i) {
+                    const int64_t d = (int64_t) kv_self.cells[i].pos - pos_prev;
+                    llama_state_write_varint(pos_buf, ((uint64_t) d << 1) ^ (uint64_t) (d >> 63));
+                    pos_prev = kv_self.cells[i].pos;
+                }
+            }
+
+            const uint32_t pos_size = pos_buf.size();
+            write(&pos_size, sizeof(pos_size));
+
+            if (pos_size) {
+                write(pos_buf.data(), pos_size);
+            }
+        }
+
+        std::vector<uint8_t> src_buf;
+        std::vector<uint8_t> dst_buf;
+        std::vector<float>   f32_buf;
+        std::vector<float>   f32_trans;
+
+        // K of all layers first, then V
+        for (int i_kv = 0; i_kv < 2; ++i_kv) {
+            for (uint32_t il = 0; il < n_layer; ++il) {
+                const struct ggml_tensor * t = i_kv == 0 ? kv_self.k_l[il] : kv_self.v_l[il];
+
+                const int64_t n_embd = i_kv == 0 ?
+                    hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s() :
+                    hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+                const ggml_type type = llama_state_compressed_type(t->type, n_embd, kv_self.recurrent);
+
+                const int32_t type_i = (int32_t) type;
+                write(&type_i, sizeof(type_i));
+
+                const size_t size_row = ggml_row_size(type, n_embd);
+
+                if (size_only()) {
+                    write(nullptr, cell_count*size_row);
+                    continue;
+                }
+
+                if (cell_count == 0) {
+                    continue;
+                }
+
+                dst_buf.resize(cell_count*size_row);
+
+                if (i_kv == 1 && kv_self.v_trans) {
+                    // gather the elements of the cells from each row of V and transpose them
+                    const size_t size_el = ggml_type_size(t->type);
+
+                    src_buf.resize(n_embd*cell_count*size_el);
+                    f32_buf.resize(n_embd*cell_count);
+                    f32_trans.resize(n_embd*cell_count);
+
+                    for (int64_t j = 0; j < n_embd; ++j) {
+                        size_t offs = j*cell_count*size_el;
+                        for (const auto & range : cell_ranges) {
+                            const size_t range_size = range.second - range.first;
+                            ggml_backend_tensor_get(t, src_buf.data() + offs, (range.first + j*kv_self.size)*size_el, range_size*size_el);
+                            offs += range_size*size_el;
+                        }
+                    }
+
+                    if (!llama_state_rows_to_f32(t->type, src_buf.data(), f32_buf.data(), n_embd*cell_count)) {
+                        throw std::runtime_error("failed to compress kv cache");
+                    }
+
+                    for (int64_t j = 0; j < n_embd; ++j) {
+                        for (uint32_t i = 0; i < cell_count; ++i) {
+                            f32_trans[i*n_embd + j] = f32_buf[j*cell_count + i];
+                        }
+                    }
+
+                    if (!llama_state_rows_from_f32(type, f32_trans.data(), dst_buf.data(), cell_count, n_embd)) {
+                        throw std::runtime_error("failed to compress kv cache");
+                    }
+                } else {
+                    const size_t size_row_src = ggml_row_size(t->type, n_embd);
+
+                    uint8_t * buf = dst_buf.data();
+                    if (type != t->type) {
+                        src_buf.resize(cell_count*size_row_src);
+                        buf = src_buf.data();
+                    }
+
+                    size_t offs = 0;
+                    for (const auto & range : cell_ranges) {
+                        const size_t range_size = range.second - range.first;
+                        ggml_backend_tensor_get(t, buf + offs, range.first*size_row_src, range_size*size_row_src);
+                        offs += range_size*size_row_src;
+                    }
+
+                    if (type != t->type) {
+                        f32_buf.resize(n_embd*cell_count);
+
+                        if (!llama_state_rows_to_f32(t->type, src_buf.data(), f32_buf.data(), n_embd*cell_count) ||
+                            !llama_state_rows_from_f32(type, f32_buf.data(), dst_buf.data(), cell_count, n_embd)) {
+                            throw std::runtime_error("failed to compress kv cache");
+                        }
+                    }
+                }
+
+                write(dst_buf.data(), dst_buf.size());
+            }
+        }
+    }
 };
 
 struct llama_data_read {
@@ -20350,6 +21225,9 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // skip the padding before the next tensor data block (files only)
+    virtual void align() {}
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -20432,19 +21310,40 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
+    // allocate the cells at the positions of batch for dest_seq_id, as one contiguous block starting at kv_self.head
+    static bool find_kv_cache_seq_slot(struct llama_kv_cache & kv_self, llama_ubatch & batch, uint32_t cell_count, llama_seq_id & dest_seq_id) {
+        batch.n_seq_id[0] = 1;
+        batch.seq_id[0] = &dest_seq_id;
+        if (!llama_kv_cache_find_slot(kv_self, batch)) {
+            LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+            return false;
+        }
+
+        // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
+        // Assume that this is one contiguous block of cells
+        GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+        GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
+        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+        GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
+        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+
+        return true;
+    }
+
+    // delta: keep the cells of dest_seq_id before the first position of the restored cells
+    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1, bool delta = false) {
         struct llama_kv_cache & kv_self = ctx->kv_self;
 
         if (dest_seq_id != -1) {
             // single sequence
 
-            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
-
             llama_ubatch batch = ctx->sbatch.reserve_ubatch(cell_count, /* has_embd */ false);
             batch.n_tokens = cell_count;
             batch.n_seq_tokens = cell_count;
             batch.n_seqs = 1;
 
+            llama_pos pos_min = std::numeric_limits<llama_pos>::max();
+
             for (uint32_t i = 0; i < cell_count; ++i) {
                 llama_pos pos;
                 uint32_t n_seq_id;
@@ -20458,21 +21357,21 @@ struct llama_data_read {
                 }
 
                 batch.pos[i] = pos;
+                pos_min = std::min(pos_min, pos);
+            }
+
+            if (!delta || kv_self.recurrent) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            } else if (cell_count > 0) {
+                // the delta replaces the cells of the sequence from its first position on
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, pos_min, -1);
+            } else {
+                // empty delta
+                return true;
             }
-            batch.n_seq_id[0] = 1;
-            batch.seq_id[0] = &dest_seq_id;
-            if (!llama_kv_cache_find_slot(kv_self, batch)) {
-                LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
+            if (!find_kv_cache_seq_slot(kv_self, batch, cell_count, dest_seq_id)) {
                 return false;
             }
-
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
         } else {
             // whole KV cache restore
 
@@ -20482,6 +21381,7 @@ struct llama_data_read {
             }
 
             llama_kv_cache_clear(kv_self);
+            kv_self.seq_cells_valid = false;
 
             for (uint32_t i = 0; i < cell_count; ++i) {
                 llama_kv_cell & cell = kv_self.cells[i];
@@ -20574,6 +21474,8 @@ struct llama_data_read {
                 return false;
             }
 
+            align();
+
             if (cell_count) {
                 // Read and set the keys for the whole cell range
                 ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
@@ -20602,6 +21504,8 @@ struct llama_data_read {
                     return false;
                 }
 
+                align();
+
                 if (cell_count) {
                     // Read and set the values for the whole cell range
                     ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
@@ -20638,6 +21542,8 @@ struct llama_data_read {
                     return false;
                 }
 
+                align();
+
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
@@ -20650,11 +21556,11 @@ struct llama_data_read {
         return true;
     }
 
-    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1, bool delta = false) {
         uint32_t cell_count;
         read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        bool res = read_kv_cache_meta(ctx, cell_count, seq_id, delta) && read_kv_cache_data(ctx, cell_count);
 
         if (!res) {
             if (seq_id == -1) {
@@ -20665,6 +21571,214 @@ struct llama_data_read {
             throw std::runtime_error("failed to restore kv cache");
         }
     }
+
+    // see llama_data_write::write_kv_cache_compressed
+    bool read_kv_cache_meta_compressed(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id) {
+        struct llama_kv_cache & kv_self = ctx->kv_self;
+
+        uint32_t pos_size;
+        read_to(&pos_size, sizeof(pos_size));
+
+        const uint8_t * pos_ptr = read(pos_size);
+        const uint8_t * pos_end = pos_ptr + pos_size;
+
+        llama_ubatch batch = ctx->sbatch.reserve_ubatch(cell_count, /* has_embd */ false);
+        batch.n_tokens = cell_count;
+        batch.n_seq_tokens = cell_count;
+        batch.n_seqs = 1;
+
+        int64_t pos = -1;
+        for (uint32_t i = 0; i < cell_count; ++i) {
+            uint64_t z;
+            if (!llama_state_read_varint(pos_ptr, pos_end, z)) {
+                LLAMA_LOG_ERROR("%s: invalid kv cell positions\n", __func__);
+                return false;
+            }
+
+            pos += (int64_t) (z >> 1) ^ -(int64_t) (z & 1);
+            if (pos < 0 || pos > std::numeric_limits<llama_pos>::max()) {
+                LLAMA_LOG_ERROR("%s: invalid kv cell position %" PRId64 "\n", __func__, pos);
+                return false;
+            }
+
+            batch.pos[i] = (llama_pos) pos;
+        }
+
+        llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+
+        if (cell_count == 0) {
+            return true;
+        }
+
+        if (!find_kv_cache_seq_slot(kv_self, batch, cell_count, dest_seq_id)) {
+            return false;
+        }
+
+        if (kv_self.recurrent) {
+            for (uint32_t i = 0; i < cell_count; ++i) {
+                uint32_t cell_id = kv_self.head + i;
+                // make sure the recurrent states will keep their restored state
+                kv_self.cells[cell_id].src = cell_id;
+            }
+        }
+
+        return true;
+    }
+
+    // the rows must have the shape of the rows of the destination cache
+    bool read_kv_cache_header_compressed(struct llama_context * ctx) {
+        const struct llama_hparams & hparams = ctx->model.hparams;
+        const struct llama_kv_cache & kv_self = ctx->kv_self;
+
+        uint32_t magic;
+        read_to(&magic, sizeof(magic));
+
+        uint32_t version;
+        read_to(&version, sizeof(version));
+
+        if (magic != LLAMA_STATE_SEQ_COMPRESSED_MAGIC || version != LLAMA_STATE_SEQ_COMPRESSED_VERSION) {
+            LLAMA_LOG_ERROR("%s: unknown compressed state format: magic = %08x, version = %u\n", __func__, magic, version);
+            return false;
+        }
+
+        uint32_t n_layer;
+        read_to(&n_layer, sizeof(n_layer));
+
+        if (n_layer != hparams.n_layer) {
+            LLAMA_LOG_ERROR("%s: mismatched layer count (%u != %u)\n", __func__, n_layer, hparams.n_layer);
+            return false;
+        }
+
+        uint32_t recurrent;
+        read_to(&recurrent, sizeof(recurrent));
+
+        if ((bool) recurrent != kv_self.recurrent) {
+            LLAMA_LOG_ERROR("%s: mismatched kv cache layout (recurrent %u != %d)\n", __func__, recurrent, kv_self.recurrent);
+            return false;
+        }
+
+        for (uint32_t il = 0; il < n_layer; ++il) {
+            uint32_t n_embd_k;
+            uint32_t n_embd_v;
+            read_to(&n_embd_k, sizeof(n_embd_k));
+            read_to(&n_embd_v, sizeof(n_embd_v));
+
+            const uint32_t n_embd_k_ref = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
+            const uint32_t n_embd_v_ref = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+            if (n_embd_k != n_embd_k_ref) {
+                LLAMA_LOG_ERROR("%s: mismatched key row size for layer %d (%u != %u)\n", __func__, il, n_embd_k, n_embd_k_ref);
+                return false;
+            }
+            if (n_embd_v != n_embd_v_ref) {
+                LLAMA_LOG_ERROR("%s: mismatched value row size for layer %d (%u != %u)\n", __func__, il, n_embd_v, n_embd_v_ref);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // the rows are converted to the type and layout of the destination cache
+    bool read_kv_cache_data_compressed(struct llama_context * ctx, uint32_t cell_count) {
+        const struct llama_hparams & hparams = ctx->model.hparams;
+        struct llama_kv_cache & kv_self = ctx->kv_self;
+
+        const uint32_t n_layer = hparams.n_layer;
+
+        std::vector<uint8_t> dst_buf;
+        std::vector<float>   f32_buf;
+        std::vector<float>   f32_trans;
+
+        for (int i_kv = 0; i_kv < 2; ++i_kv) {
+            for (uint32_t il = 0; il < n_layer; ++il) {
+                struct ggml_tensor * t = i_kv == 0 ? kv_self.k_l[il] : kv_self.v_l[il];
+
+                const int64_t n_embd = i_kv == 0 ?
+                    hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s() :
+                    hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+                int32_t type_i;
+                read_to(&type_i, sizeof(type_i));
+
+                if (type_i < 0 || type_i >= GGML_TYPE_COUNT || ggml_blck_size((ggml_type) type_i) == 0 ||
+                    n_embd % ggml_blck_size((ggml_type) type_i) != 0) {
+                    LLAMA_LOG_ERROR("%s: invalid kv type %d for layer %d\n", __func__, type_i, il);
+                    return false;
+                }
+
+                const ggml_type type = (ggml_type) type_i;
+
+                if (cell_count == 0) {
+                    continue;
+                }
+
+                const uint8_t * src = read(cell_count*ggml_row_size(type, n_embd));
+
+                if (i_kv == 1 && kv_self.v_trans) {
+                    const size_t size_el = ggml_type_size(t->type);
+
+                    f32_buf.resize(n_embd*cell_count);
+                    f32_trans.resize(n_embd*cell_count);
+                    dst_buf.resize(n_embd*cell_count*size_el);
+
+                    if (!llama_state_rows_to_f32(type, src, f32_buf.data(), n_embd*cell_count)) {
+                        return false;
+                    }
+
+                    for (uint32_t i = 0; i < cell_count; ++i) {
+                        for (int64_t j = 0; j < n_embd; ++j) {
+                            f32_trans[j*cell_count + i] = f32_buf[i*n_embd + j];
+                        }
+                    }
+
+                    if (!llama_state_rows_from_f32(t->type, f32_trans.data(), dst_buf.data(), n_embd, cell_count)) {
+                        return false;
+                    }
+
+                    for (int64_t j = 0; j < n_embd; ++j) {
+                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * size_el;
+                        ggml_backend_tensor_set(t, dst_buf.data() + j*cell_count*size_el, dst_offset, cell_count * size_el);
+                    }
+                } else {
+                    const size_t size_row = ggml_row_size(t->type, n_embd);
+
+                    if (type == t->type) {
+                        ggml_backend_tensor_set(t, src, kv_self.head * size_row, cell_count * size_row);
+                        continue;
+                    }
+
+                    f32_buf.resize(n_embd*cell_count);
+                    dst_buf.resize(cell_count*size_row);
+
+                    if (!llama_state_rows_to_f32(type, src, f32_buf.data(), n_embd*cell_count) ||
+                        !llama_state_rows_from_f32(t->type, f32_buf.data(), dst_buf.data(), cell_count, n_embd)) {
+                        return false;
+                    }
+
+                    ggml_backend_tensor_set(t, dst_buf.data(), kv_self.head * size_row, cell_count * size_row);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void read_kv_cache_compressed(struct llama_context * ctx, llama_seq_id seq_id) {
+        if (!read_kv_cache_header_compressed(ctx)) {
+            throw std::runtime_error("incompatible compressed sequence state");
+        }
+
+        uint32_t cell_count;
+        read_to(&cell_count, sizeof(cell_count));
+
+        bool res = read_kv_cache_meta_compressed(ctx, cell_count, seq_id) && read_kv_cache_data_compressed(ctx, cell_count);
+
+        if (!res) {
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            throw std::runtime_error("failed to restore kv cache");
+        }
+    }
 };
 
 struct llama_data_write_dummy : llama_data_write {
@@ -20683,6 +21797,10 @@ struct llama_data_write_dummy : llama_data_write {
     size_t get_size_written() override {
         return size_written;
     }
+
+    bool size_only() const override {
+        return true;
+    }
 };
 
 struct llama_data_write_buffer : llama_data_write {
@@ -20757,6 +21875,12 @@ struct llama_data_write_file : llama_data_write {
     }
 
     void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        if (tensor->buffer && ggml_backend_buffer_is_host(tensor->buffer)) {
+            // write straight from the tensor, no staging copy
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
+
         temp_buffer.resize(size);
         ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
         write(temp_buffer.data(), temp_buffer.size());
@@ -20765,6 +21889,16 @@ struct llama_data_write_file : llama_data_write {
     size_t get_size_written() override {
         return size_written;
     }
+
+    void align() override {
+        const size_t pos = file->tell();
+        const size_t pad = GGML_PAD(pos, LLAMA_STATE_FILE_ALIGNMENT) - pos;
+
+        if (pad) {
+            temp_buffer.assign(pad, 0);
+            write(temp_buffer.data(), pad);
+        }
+    }
 };
 
 struct llama_data_read_file : llama_data_read {
@@ -20788,8 +21922,44 @@ struct llama_data_read_file : llama_data_read {
     size_t get_size_read() override {
         return size_read;
     }
+
+    void align() override {
+        const size_t pos = file->tell();
+        const size_t pad = GGML_PAD(pos, LLAMA_STATE_FILE_ALIGNMENT) - pos;
+
+        file->seek(pad, SEEK_CUR);
+        size_read += pad;
+    }
+};
+
+// reads the state of a session file from a mapping of the whole file
+// the tensor data is set directly from the mapped pages, without a staging copy
+struct llama_data_read_mmap : llama_data_read_buffer {
+    const uint8_t * base;
+
+    llama_data_read_mmap(const llama_mmap & mapping, size_t offset)
+        : llama_data_read_buffer((const uint8_t *) mapping.addr + offset, mapping.size - offset), base((const uint8_t *) mapping.addr) {}
+
+    void align() override {
+        const size_t pos = ptr - base;
+        const size_t pad = GGML_PAD(pos, LLAMA_STATE_FILE_ALIGNMENT) - pos;
+
+        read(pad);
+    }
 };
 
+// restore the state that follows the header of a session file, from a mapping of the file if possible
+static size_t llama_state_read_file(llama_file & file, const std::function<size_t(llama_data_read &)> & read_state) {
+    if (llama_mmap::SUPPORTED && file.size > file.tell()) {
+        llama_mmap mapping(&file);
+        llama_data_read_mmap data_ctx(mapping, file.tell());
+        return read_state(data_ctx);
+    }
+
+    llama_data_read_file data_ctx(&file);
+    return read_state(data_ctx);
+}
+
 /** copy state data into either a buffer or file depending on the passed in context
  *
  * file context:
@@ -20897,8 +22067,9 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
     {
         const size_t n_state_size_cur = file.size - file.tell();
 
-        llama_data_read_file data_ctx(&file);
-        const size_t n_read = llama_state_set_data_internal(ctx, data_ctx);
+        const size_t n_read = llama_state_read_file(file, [&](llama_data_read & data_ctx) {
+            return llama_state_set_data_internal(ctx, data_ctx);
+        });
 
         if (n_read != n_state_size_cur) {
             LLAMA_LOG_ERROR("%s: did not read all of the session file data! size %zu, got %zu\n", __func__, n_state_size_cur, n_read);
@@ -20943,10 +22114,10 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
     }
 }
 
-static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
+static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id, llama_pos p0 = -1) {
     llama_synchronize(ctx);
 
-    data_ctx.write_kv_cache(ctx, seq_id);
+    data_ctx.write_kv_cache(ctx, seq_id, p0);
 
     return data_ctx.get_size_written();
 }
@@ -20966,10 +22137,10 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
     }
 }
 
-static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
+static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id, bool delta = false) {
     llama_synchronize(ctx);
 
-    data_ctx.read_kv_cache(ctx, dest_seq_id);
+    data_ctx.read_kv_cache(ctx, dest_seq_id, delta);
 
     return data_ctx.get_size_read();
 }
@@ -20984,6 +22155,76 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     }
 }
 
+size_t llama_state_seq_get_size_delta(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
+    llama_data_write_dummy data_ctx;
+    return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, std::max(p0, 0));
+}
+
+size_t llama_state_seq_get_data_delta(struct llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0) {
+    llama_data_write_buffer data_ctx(dst, size);
+    try {
+        return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, std::max(p0, 0));
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state delta: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_set_data_delta(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    llama_data_read_buffer data_ctx(src, size);
+    try {
+        return llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id, true);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading sequence state delta: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+static size_t llama_state_seq_get_data_ext_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    if (!(flags & LLAMA_STATE_SEQ_FLAGS_COMPRESS)) {
+        return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+    }
+
+    llama_synchronize(ctx);
+
+    data_ctx.write_kv_cache_compressed(ctx, seq_id);
+
+    return data_ctx.get_size_written();
+}
+
+size_t llama_state_seq_get_size_ext(struct llama_context * ctx, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    llama_data_write_dummy data_ctx;
+    return llama_state_seq_get_data_ext_internal(ctx, data_ctx, seq_id, flags);
+}
+
+size_t llama_state_seq_get_data_ext(struct llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_state_seq_flags flags) {
+    llama_data_write_buffer data_ctx(dst, size);
+    try {
+        return llama_state_seq_get_data_ext_internal(ctx, data_ctx, seq_id, flags);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_set_data_ext(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id, llama_state_seq_flags flags) {
+    if (!(flags & LLAMA_STATE_SEQ_FLAGS_COMPRESS)) {
+        return llama_state_seq_set_data(ctx, src, size, dest_seq_id);
+    }
+
+    llama_data_read_buffer data_ctx(src, size);
+    try {
+        llama_synchronize(ctx);
+
+        data_ctx.read_kv_cache_compressed(ctx, dest_seq_id);
+
+        return data_ctx.get_size_read();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     llama_file file(filepath, "wb");
 
@@ -21033,17 +22274,17 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
     // restore the context state
     {
         const size_t state_size = file.size - file.tell();
-        llama_data_read_file data_ctx(&file);
-        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        const size_t nread = llama_state_read_file(file, [&](llama_data_read & data_ctx) {
+            return llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        });
         if (!nread) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
         }
         GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
-    }
 
-    return file.tell();
+        return nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out;
+    }
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -21421,6 +22662,20 @@ int32_t llama_tokenize(
     return llama_tokenize_impl(model->vocab, text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_model * model,
+           const char * const * texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * n_tokens,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return llama_tokenize_batch_impl(model->vocab, texts, text_lens, n_texts, tokens, n_tokens_max, n_tokens, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_model * model,
                  llama_token   token,
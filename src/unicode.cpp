@@ -7,9 +7,12 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -542,6 +545,601 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// compiled pre-tokenizer regexes
+//
+// small backtracking matcher for the subset of the ECMAScript syntax used by the pre-tokenizers:
+// literals, classes with ranges, \s \S \d \D \p{L} \p{N} \p{P}, groups, (?= ) and (?! ) lookaheads,
+// greedy quantifiers and $. it follows the semantics of the std::regex fallback below (ordered
+// alternation, non-ASCII whitespace handled as 0x0B, unicode categories matched by codepoint flags)
+// but works directly on the codepoints, which is much faster than std::wregex
+//
+
+struct unicode_regex_class {
+    uint64_t ascii[2] = { 0, 0 };                       // membership of the codepoints < 128
+    uint16_t categories = 0;                            // codepoint_flags categories of the non-ASCII members
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;  // non-ASCII ranges, sorted
+    bool negated = false;
+
+    bool contains(uint32_t cpt, codepoint_flags flags) const {
+        if (cpt < 128) {
+            return (ascii[cpt >> 6] >> (cpt & 63)) & 1;
+        }
+        if (flags.is_whitespace) {
+            return (ascii[0] >> 0x0B) & 1; // same as std::regex fallback
+        }
+        bool found = (flags.as_uint() & categories) != 0;
+        if (!found && !ranges.empty()) {
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), cpt,
+                [](uint32_t c, const std::pair<uint32_t, uint32_t> & r) { return c < r.first; });
+            found = it != ranges.begin() && cpt <= (it - 1)->second;
+        }
+        return found != negated;
+    }
+
+    void add_range(uint32_t first, uint32_t last) {
+        for (uint32_t c = first; c <= last && c < 128; ++c) {
+            ascii[c >> 6] |= uint64_t(1) << (c & 63);
+        }
+        if (last >= 128) {
+            ranges.emplace_back(std::max<uint32_t>(first, 128), last);
+        }
+    }
+
+    void add_category(uint16_t category) {
+        for (uint32_t c = 0; c < 128; ++c) {
+            if (unicode_cpt_flags(c).as_uint() & category) {
+                ascii[c >> 6] |= uint64_t(1) << (c & 63);
+            }
+        }
+        categories |= category;
+    }
+
+    void add_whitespace() {
+        add_range(0x09, 0x0D);
+        add_range(0x20, 0x20);
+    }
+
+    void finalize() {
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<uint32_t, uint32_t>> merged;
+        for (const auto & r : ranges) {
+            if (!merged.empty() && r.first <= merged.back().second + 1) {
+                merged.back().second = std::max(merged.back().second, r.second);
+            } else {
+                merged.push_back(r);
+            }
+        }
+        ranges = std::move(merged);
+        if (negated) {
+            ascii[0] = ~ascii[0];
+            ascii[1] = ~ascii[1];
+        }
+    }
+};
+
+struct unicode_regex_prog {
+    enum op_type {
+        OP_CLASS, // match one codepoint of classes[x]
+        OP_SPLIT, // try x, on failure y
+        OP_JMP,   // continue at x
+        OP_LOOK,  // lookahead program starting at pc + 1 and ending at x, y = negated
+        OP_EOS,   // end of input
+        OP_MATCH,
+    };
+
+    struct inst {
+        op_type op;
+        int x;
+        int y;
+    };
+
+    std::vector<inst> code;
+    std::vector<unicode_regex_class> classes;
+
+    // returns the end of the match starting at pos, or -1
+    int64_t match(int pc, size_t pos, size_t end, const uint32_t * cpts, const codepoint_flags * flags,
+                  std::vector<std::pair<int, size_t>> & stack) const {
+        const size_t base = stack.size();
+        while (true) {
+            const inst & in = code[pc];
+            bool fail = false;
+            switch (in.op) {
+                case OP_CLASS:
+                    if (pos < end && classes[in.x].contains(cpts[pos], flags[pos])) {
+                        pos++;
+                        pc++;
+                    } else {
+                        fail = true;
+                    }
+                    break;
+                case OP_SPLIT:
+                    stack.emplace_back(in.y, pos);
+                    pc = in.x;
+                    break;
+                case OP_JMP:
+                    pc = in.x;
+                    break;
+                case OP_LOOK:
+                    if ((match(pc + 1, pos, end, cpts, flags, stack) >= 0) != (in.y != 0)) {
+                        pc = in.x;
+                    } else {
+                        fail = true;
+                    }
+                    break;
+                case OP_EOS:
+                    if (pos == end) {
+                        pc++;
+                    } else {
+                        fail = true;
+                    }
+                    break;
+                case OP_MATCH:
+                    stack.resize(base);
+                    return pos;
+            }
+            if (fail) {
+                if (stack.size() == base) {
+                    return -1;
+                }
+                pc  = stack.back().first;
+                pos = stack.back().second;
+                stack.pop_back();
+            }
+        }
+    }
+};
+
+// parses the regex into a tree and generates the program
+// throws std::runtime_error for syntax outside of the supported subset
+struct unicode_regex_compiler {
+    enum node_type {
+        NODE_CLASS,
+        NODE_SEQ,
+        NODE_ALT,
+        NODE_REPEAT,
+        NODE_LOOK,
+        NODE_EOS,
+    };
+
+    struct node {
+        node_type type;
+        int value = 0;  // class index, or negated for lookaheads
+        int min = 0;    // repetitions, max < 0 means unbounded
+        int max = 0;
+        std::vector<node> children;
+    };
+
+    std::vector<uint32_t> re;
+    size_t pos = 0;
+    bool use_categories = false;
+    unicode_regex_prog prog;
+
+    unicode_regex_compiler(const std::string & regex_expr) : re(unicode_cpts_from_utf8(regex_expr)) {}
+
+    static void unsupported() {
+        throw std::runtime_error("unsupported regex");
+    }
+
+    bool eof() const {
+        return pos >= re.size();
+    }
+
+    uint32_t peek() const {
+        return eof() ? 0 : re[pos];
+    }
+
+    uint32_t next() {
+        if (eof()) {
+            unsupported();
+        }
+        return re[pos++];
+    }
+
+    int add_class(unicode_regex_class && cls) {
+        cls.finalize();
+        prog.classes.push_back(std::move(cls));
+        return (int) prog.classes.size() - 1;
+    }
+
+    node make_class(int idx) {
+        node n;
+        n.type  = NODE_CLASS;
+        n.value = idx;
+        return n;
+    }
+
+    // \p{X}
+    uint16_t parse_category() {
+        if (next() != '{') {
+            unsupported();
+        }
+        const uint32_t c = next();
+        if (next() != '}') {
+            unsupported();
+        }
+        use_categories = true;
+        switch (c) {
+            case 'L': return codepoint_flags::LETTER;
+            case 'N': return codepoint_flags::NUMBER;
+            case 'P': return codepoint_flags::PUNCTUATION;
+            default: unsupported();
+        }
+        return 0;
+    }
+
+    static uint32_t escape_char(uint32_t c) {
+        switch (c) {
+            case 'r': return '\r';
+            case 'n': return '\n';
+            case 't': return '\t';
+            case 'f': return '\f';
+            case 'v': return '\v';
+            case '0': return '\0';
+        }
+        if (c < 128 && (std::isalnum((int) c) || c == '_')) {
+            unsupported();
+        }
+        return c;
+    }
+
+    // adds an escape sequence to the class, returns false if it is a single codepoint
+    bool parse_escape(unicode_regex_class & cls, uint32_t & cpt, bool allow_negated) {
+        const uint32_t c = next();
+        switch (c) {
+            case 'p': cls.add_category(parse_category()); return true;
+            case 's': cls.add_whitespace();               return true;
+            case 'd': cls.add_range('0', '9');            return true;
+            case 'S':
+            case 'D':
+                if (!allow_negated) {
+                    unsupported();
+                }
+                c == 'S' ? cls.add_whitespace() : cls.add_range('0', '9');
+                cls.negated = true;
+                return true;
+        }
+        cpt = escape_char(c);
+        return false;
+    }
+
+    node parse_bracket() {
+        unicode_regex_class cls;
+        if (peek() == '^') {
+            cls.negated = true;
+            next();
+        }
+        bool first = true;
+        while (peek() != ']' || first) {
+            first = false;
+            uint32_t lo = next();
+            if (lo == '\\' && parse_escape(cls, lo, false)) {
+                continue;
+            }
+            if (peek() == '-' && pos + 1 < re.size() && re[pos + 1] != ']') {
+                next();
+                uint32_t hi = next();
+                if (hi == '\\' && parse_escape(cls, hi, false)) {
+                    unsupported();
+                }
+                if (hi < lo) {
+                    unsupported();
+                }
+                cls.add_range(lo, hi);
+            } else {
+                cls.add_range(lo, lo);
+            }
+        }
+        next();
+        return make_class(add_class(std::move(cls)));
+    }
+
+    node parse_atom() {
+        const uint32_t c = next();
+        switch (c) {
+            case '(':
+                {
+                    node n;
+                    bool look = false;
+                    if (peek() == '?') {
+                        next();
+                        const uint32_t k = next();
+                        if (k == '=' || k == '!') {
+                            look = true;
+                            n.type  = NODE_LOOK;
+                            n.value = k == '!';
+                        } else if (k != ':') {
+                            unsupported();
+                        }
+                    }
+                    node inner = parse_alt();
+                    if (next() != ')') {
+                        unsupported();
+                    }
+                    if (!look) {
+                        return inner;
+                    }
+                    n.children.push_back(std::move(inner));
+                    return n;
+                }
+            case '[':
+                return parse_bracket();
+            case '$':
+                {
+                    node n;
+                    n.type = NODE_EOS;
+                    return n;
+                }
+            case '\\':
+                {
+                    unicode_regex_class cls;
+                    uint32_t cpt = 0;
+                    if (!parse_escape(cls, cpt, true)) {
+                        cls.add_range(cpt, cpt);
+                    }
+                    return make_class(add_class(std::move(cls)));
+                }
+            case '^': case '.': case ')': case '|':
+            case '*': case '+': case '?': case '{':
+                unsupported();
+        }
+        unicode_regex_class cls;
+        cls.add_range(c, c);
+        return make_class(add_class(std::move(cls)));
+    }
+
+    int parse_int() {
+        if (!std::isdigit((int) peek())) {
+            unsupported();
+        }
+        int v = 0;
+        while (std::isdigit((int) peek())) {
+            v = 10*v + (int) (next() - '0');
+        }
+        return v;
+    }
+
+    static bool nullable(const node & n) {
+        switch (n.type) {
+            case NODE_CLASS:  return false;
+            case NODE_LOOK:   return true;
+            case NODE_EOS:    return true;
+            case NODE_REPEAT: return n.min == 0 || nullable(n.children[0]);
+            case NODE_SEQ:
+                for (const auto & c : n.children) {
+                    if (!nullable(c)) {
+                        return false;
+                    }
+                }
+                return true;
+            case NODE_ALT:
+                for (const auto & c : n.children) {
+                    if (nullable(c)) {
+                        return true;
+                    }
+                }
+                return false;
+        }
+        return true;
+    }
+
+    node parse_repeat() {
+        node atom = parse_atom();
+        while (true) {
+            int min = 0;
+            int max = 0;
+            const uint32_t c = peek();
+            if (c == '*') {
+                min = 0; max = -1;
+            } else if (c == '+') {
+                min = 1; max = -1;
+            } else if (c == '?') {
+                min = 0; max = 1;
+            } else if (c == '{') {
+                next();
+                min = max = parse_int();
+                if (peek() == ',') {
+                    next();
+                    max = peek() == '}' ? -1 : parse_int();
+                }
+                if (peek() != '}' || (max >= 0 && max < min)) {
+                    unsupported();
+                }
+            } else {
+                return atom;
+            }
+            next();
+            if (peek() == '?') {
+                unsupported(); // lazy quantifiers
+            }
+            if (max < 0 && nullable(atom)) {
+                unsupported(); // empty loop iterations
+            }
+            node n;
+            n.type = NODE_REPEAT;
+            n.min  = min;
+            n.max  = max;
+            n.children.push_back(std::move(atom));
+            atom = std::move(n);
+        }
+    }
+
+    node parse_seq() {
+        node n;
+        n.type = NODE_SEQ;
+        while (!eof() && peek() != '|' && peek() != ')') {
+            n.children.push_back(parse_repeat());
+        }
+        return n;
+    }
+
+    node parse_alt() {
+        node n;
+        n.type = NODE_ALT;
+        n.children.push_back(parse_seq());
+        while (peek() == '|') {
+            next();
+            n.children.push_back(parse_seq());
+        }
+        return n;
+    }
+
+    int emit(unicode_regex_prog::op_type op, int x = 0, int y = 0) {
+        prog.code.push_back({ op, x, y });
+        return (int) prog.code.size() - 1;
+    }
+
+    void gen(const node & n) {
+        auto & code = prog.code;
+        switch (n.type) {
+            case NODE_CLASS:
+                emit(unicode_regex_prog::OP_CLASS, n.value);
+                break;
+            case NODE_EOS:
+                emit(unicode_regex_prog::OP_EOS);
+                break;
+            case NODE_SEQ:
+                for (const auto & c : n.children) {
+                    gen(c);
+                }
+                break;
+            case NODE_ALT:
+                {
+                    std::vector<int> jumps;
+                    for (size_t i = 0; i < n.children.size(); ++i) {
+                        int split = -1;
+                        if (i + 1 < n.children.size()) {
+                            split = emit(unicode_regex_prog::OP_SPLIT);
+                            code[split].x = split + 1;
+                        }
+                        gen(n.children[i]);
+                        if (split >= 0) {
+                            jumps.push_back(emit(unicode_regex_prog::OP_JMP));
+                            code[split].y = (int) code.size();
+                        }
+                    }
+                    for (int j : jumps) {
+                        code[j].x = (int) code.size();
+                    }
+                } break;
+            case NODE_LOOK:
+                {
+                    const int look = emit(unicode_regex_prog::OP_LOOK, 0, n.value);
+                    gen(n.children[0]);
+                    emit(unicode_regex_prog::OP_MATCH);
+                    code[look].x = (int) code.size();
+                } break;
+            case NODE_REPEAT:
+                {
+                    for (int i = 0; i < n.min; ++i) {
+                        gen(n.children[0]);
+                    }
+                    if (n.max < 0) {
+                        const int split = emit(unicode_regex_prog::OP_SPLIT);
+                        code[split].x = split + 1;
+                        gen(n.children[0]);
+                        emit(unicode_regex_prog::OP_JMP, split);
+                        code[split].y = (int) code.size();
+                    } else {
+                        std::vector<int> splits;
+                        for (int i = n.min; i < n.max; ++i) {
+                            const int split = emit(unicode_regex_prog::OP_SPLIT);
+                            code[split].x = split + 1;
+                            splits.push_back(split);
+                            gen(n.children[0]);
+                        }
+                        for (int s : splits) {
+                            code[s].y = (int) code.size();
+                        }
+                    }
+                } break;
+        }
+    }
+
+    unicode_regex_prog compile() {
+        node root = parse_alt();
+        if (!eof()) {
+            unsupported();
+        }
+        if (use_categories) {
+            // same restriction as the collapsed std::regex fallback
+            for (uint32_t c : re) {
+                if (c >= 128) {
+                    unsupported();
+                }
+            }
+        }
+        gen(root);
+        emit(unicode_regex_prog::OP_MATCH);
+        return std::move(prog);
+    }
+};
+
+// returns nullptr if the regex cannot be compiled
+// the programs are compiled once and shared, each thread keeps its own index of them so that the lookups done for
+// every tokenized text do not take the lock
+static const unicode_regex_prog * unicode_regex_get_prog(const std::string & regex_expr) {
+    thread_local std::unordered_map<std::string, const unicode_regex_prog *> cache_local;
+
+    const auto it_local = cache_local.find(regex_expr);
+    if (it_local != cache_local.end()) {
+        return it_local->second;
+    }
+
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex_prog>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(regex_expr);
+    if (it == cache.end()) {
+        std::unique_ptr<unicode_regex_prog> prog;
+        try {
+            prog.reset(new unicode_regex_prog(unicode_regex_compiler(regex_expr).compile()));
+        } catch (const std::exception &) {
+            // leave it to std::regex
+        }
+        it = cache.emplace(regex_expr, std::move(prog)).first;
+    }
+
+    cache_local.emplace(regex_expr, it->second.get());
+
+    return it->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_prog(const unicode_regex_prog & prog, const std::vector<uint32_t> & cpts, const std::vector<codepoint_flags> & flags, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    std::vector<std::pair<int, size_t>> stack;
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; ) {
+            const int64_t match_end = prog.match(0, pos, end, cpts.data(), flags.data(), stack);
+            if (match_end <= (int64_t) pos) { // no match, empty matches are skipped
+                pos++;
+                continue;
+            }
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+            bpe_offsets.push_back(match_end - pos);
+            pos = prev_end = match_end;
+        }
+
+        if (prev_end < end) {
+            bpe_offsets.push_back(end - prev_end);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -670,9 +1268,12 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
+    // compute collapsed codepoints only if needed by at least one regex handled by std::regex
     bool need_collapse = false;
     for (auto & regex_expr : regex_exprs) {
+        if (unicode_regex_get_prog(regex_expr)) {
+            continue;
+        }
         // search for unicode categories
         for (const auto & ucat : k_ucat_enum) {
             if (std::string::npos != regex_expr.find(ucat.first)) {
@@ -714,6 +1315,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
+    std::vector<codepoint_flags> cpt_flags;
+
     for (auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
         auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
@@ -723,6 +1326,19 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
+        // next, try to compile the regex for the built-in matcher
+        const unicode_regex_prog * prog = unicode_regex_get_prog(regex_expr);
+        if (prog) {
+            if (cpt_flags.empty()) {
+                cpt_flags.resize(cpts.size());
+                for (size_t i = 0; i < cpts.size(); ++i) {
+                    cpt_flags[i] = unicode_cpt_flags(cpts[i]);
+                }
+            }
+            bpe_offsets = unicode_regex_split_prog(*prog, cpts, cpt_flags, bpe_offsets);
+            continue;
+        }
+
         // fallback to general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
@@ -1800,9 +1800,10 @@ struct test_out_prod : public test_case {
     const int64_t k;
     const std::array<int64_t, 2> bs; // dims 3 and 4
     const bool trans_b;
+    const std::array<int64_t, 2> nr; // repeat in dims 3 and 4
 
     std::string vars() override {
-        return VARS_TO_STR7(type_a, type_b, m, n, k, bs, trans_b);
+        return VARS_TO_STR8(type_a, type_b, m, n, k, bs, trans_b, nr);
     }
 
     double max_nmse_err() override {
@@ -1812,8 +1813,9 @@ struct test_out_prod : public test_case {
     test_out_prod(ggml_type type_a = GGML_TYPE_F32, ggml_type type_b = GGML_TYPE_F32,
             int64_t m = 32, int64_t n = 32, int64_t k = 32,
             std::array<int64_t, 2> bs = {10, 10},
-            bool trans_b = false)
-        : type_a(type_a), type_b(type_b), m(m), n(n), k(k), bs(bs), trans_b(trans_b) {}
+            bool trans_b = false,
+            std::array<int64_t, 2> nr = {1, 1})
+        : type_a(type_a), type_b(type_b), m(m), n(n), k(k), bs(bs), trans_b(trans_b), nr(nr) {}
 
     ggml_tensor * build_graph(ggml_context * ctx) override {
         ggml_tensor * a = ggml_new_tensor_4d(ctx, type_a, m, k, bs[0], bs[1]);
@@ -1821,10 +1823,10 @@ struct test_out_prod : public test_case {
 
         ggml_tensor * b;
         if (trans_b) {
-            b = ggml_new_tensor_4d(ctx, type_b, k, n, bs[0], bs[1]);
+            b = ggml_new_tensor_4d(ctx, type_b, k, n, bs[0]*nr[0], bs[1]*nr[1]);
             b = ggml_transpose(ctx, b);
         } else {
-            b = ggml_new_tensor_4d(ctx, type_b, n, k, bs[0], bs[1]);
+            b = ggml_new_tensor_4d(ctx, type_b, n, k, bs[0]*nr[0], bs[1]*nr[1]);
         }
         ggml_set_name(b, "b");
 
@@ -3627,6 +3629,12 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
             test_cases.emplace_back(new test_out_prod(type_a, type_b, 256, 16, 16, {10, 10}));
             test_cases.emplace_back(new test_out_prod(type_a, type_b, 256, 16, 16, {10, 10}));
             test_cases.emplace_back(new test_out_prod(type_a, type_b, 256, 16, 16, {10, 10}));
+
+            if (ggml_is_quantized(type_a)) {
+                // broadcast of a over b, as used for KQV with a quantized V cache
+                test_cases.emplace_back(new test_out_prod(type_a, type_b, 256, 16, 40, { 2,  1}, true, {4, 1}));
+                test_cases.emplace_back(new test_out_prod(type_a, type_b, 256,  1, 40, { 2,  1}, true, {4, 1}));
+            }
         }
     }
 
@@ -0,0 +1,256 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-grammar.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks that the tokens allowed by the grammar sampler, which walks a trie of the vocab and caches the masks of the
+// stacks, are the ones allowed by llama_grammar_reject_candidates_for_stack applied to each token of the vocab
+
+// same as decode_utf8 in llama-grammar.cpp
+static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(const std::string & src, llama_partial_utf8 partial_start) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    const char          * pos      = src.c_str();
+    std::vector<uint32_t> code_points;
+
+    uint32_t value    = partial_start.value;
+    int      n_remain = partial_start.n_remain;
+
+    while (*pos != 0 && n_remain > 0) {
+        uint8_t next_byte = static_cast<uint8_t>(*pos);
+        if ((next_byte >> 6) != 2) {
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), llama_partial_utf8{ 0, -1 });
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+
+    if (partial_start.n_remain > 0 && n_remain == 0) {
+        code_points.push_back(value);
+    }
+
+    while (*pos != 0) {
+        uint8_t first_byte = static_cast<uint8_t>(*pos);
+        uint8_t highbits   = first_byte >> 4;
+        n_remain   = lookup[highbits] - 1;
+
+        if (n_remain < 0) {
+            code_points.clear();
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), llama_partial_utf8{ 0, n_remain });
+        }
+
+        uint8_t mask  = (1 << (7 - n_remain)) - 1;
+        value = first_byte & mask;
+
+        ++pos;
+        while (*pos != 0 && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            code_points.push_back(value);
+        }
+    }
+    code_points.push_back(0);
+
+    return std::make_pair(std::move(code_points), llama_partial_utf8{ value, n_remain });
+}
+
+// the grammar state of the reference: the stacks and the partial UTF-8 sequence of the accepted tokens
+struct reference_state {
+    const llama_grammar_rules & rules;
+    llama_grammar_stacks        stacks;
+    llama_partial_utf8          partial_utf8;
+};
+
+// allowed[id] is true if the token id is allowed by at least one of the stacks
+static std::vector<bool> reference_allowed(const llama_model * model, const std::vector<std::string> & pieces, const reference_state & state) {
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<bool> allowed(n_vocab, false);
+
+    bool allow_eog = false;
+    for (const auto & stack : state.stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+        }
+    }
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded;
+    decoded.reserve(n_vocab);
+
+    llama_grammar_candidates candidates;
+    for (int id = 0; id < n_vocab; ++id) {
+        if (llama_token_is_eog(model, id)) {
+            allowed[id] = allow_eog;
+            continue;
+        }
+        if (pieces[id].empty() || pieces[id][0] == 0) {
+            continue;
+        }
+        decoded.push_back(decode_utf8(pieces[id], state.partial_utf8));
+        candidates.push_back({ (size_t) id, decoded.back().first.data(), decoded.back().second });
+    }
+
+    for (const auto & stack : state.stacks) {
+        std::vector<bool> rejected(n_vocab, false);
+        for (const auto & reject : llama_grammar_reject_candidates_for_stack(state.rules, stack, candidates)) {
+            rejected[reject.index] = true;
+        }
+        for (const auto & cand : candidates) {
+            if (!rejected[cand.index]) {
+                allowed[cand.index] = true;
+            }
+        }
+    }
+
+    return allowed;
+}
+
+static void reference_accept(reference_state & state, const std::string & piece) {
+    const auto decoded = decode_utf8(piece, state.partial_utf8);
+
+    for (auto it = decoded.first.begin(), end = decoded.first.end() - 1; it != end; ++it) {
+        llama_grammar_stacks stacks_new;
+        llama_grammar_accept(state.rules, state.stacks, *it, stacks_new);
+        state.stacks = std::move(stacks_new);
+    }
+
+    state.partial_utf8 = decoded.second;
+    assert(!state.stacks.empty());
+}
+
+// generates n_steps random tokens allowed by the grammar and checks the allowed tokens at each step
+// returns the number of steps that started in the middle of a UTF-8 sequence
+static int test_grammar(const llama_model * model, const std::vector<std::string> & pieces, const char * grammar_str, int n_steps, uint32_t seed) {
+    fprintf(stderr, "⚫ Testing grammar: %s\n", grammar_str);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    llama_sampler * smpl = llama_sampler_init_grammar(model, grammar_str, "root");
+    assert(smpl != nullptr);
+
+    // the reference grammar has no vocab, it is only used for its rules and initial stacks
+    llama_grammar * grammar = llama_grammar_init_impl(nullptr, grammar_str, "root");
+    assert(grammar != nullptr);
+
+    reference_state state = { llama_grammar_get_rules(grammar), llama_grammar_get_stacks(grammar), { 0, 0 } };
+
+    std::mt19937 rng(seed);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    std::vector<uint32_t> mask(LLAMA_TOKEN_MASK_SIZE(n_vocab));
+
+    int n_partial = 0;
+
+    for (int step = 0; step < n_steps; ++step) {
+        if (state.partial_utf8.n_remain > 0) {
+            n_partial++;
+        }
+
+        for (int id = 0; id < n_vocab; ++id) {
+            cur[id] = { id, 0.0f, 0.0f };
+        }
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_sampler_apply(smpl, &cur_p);
+
+        const bool has_mask = llama_sampler_get_mask(smpl, mask.data(), n_vocab);
+        assert(has_mask);
+
+        const std::vector<bool> allowed = reference_allowed(model, pieces, state);
+
+        std::vector<llama_token> next;
+        std::vector<llama_token> next_bytes; // tokens that start or continue a multi-byte UTF-8 sequence
+        for (int id = 0; id < n_vocab; ++id) {
+            const bool allowed_apply = cur[id].logit != -INFINITY;
+            const bool allowed_mask  = (mask[id / 32] >> (id % 32)) & 1;
+            if (allowed_apply != allowed[id] || allowed_mask != allowed[id]) {
+                fprintf(stderr, "  ❌ step %d, token %d '%s': expected %d, apply %d, mask %d\n",
+                        step, id, pieces[id].c_str(), (int) allowed[id], (int) allowed_apply, (int) allowed_mask);
+                assert(false);
+            }
+            if (allowed[id] && !llama_token_is_eog(model, id)) {
+                next.push_back(id);
+                if (pieces[id].size() == 1 && (uint8_t) pieces[id][0] >= 0x80) {
+                    next_bytes.push_back(id);
+                }
+            }
+        }
+
+        if (next.empty()) {
+            break;
+        }
+
+        // prefer the single-byte tokens half of the time, to reach the middle of UTF-8 sequences
+        const llama_token token = !next_bytes.empty() && rng() % 2 ? next_bytes[rng() % next_bytes.size()] : next[rng() % next.size()];
+
+        llama_sampler_accept(smpl, token);
+        reference_accept(state, pieces[token]);
+    }
+
+    llama_grammar_free_impl(grammar);
+    llama_sampler_free(smpl);
+
+    fprintf(stderr, "  ✅︎ (%d steps in the middle of a UTF-8 sequence)\n", n_partial);
+
+    return n_partial;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s vocab-file\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<std::string> pieces(n_vocab);
+    for (int id = 0; id < n_vocab; ++id) {
+        char buf[256];
+        const int n = llama_token_to_piece(model, id, buf, sizeof(buf), 0, true);
+        assert(n >= 0);
+        pieces[id] = std::string(buf, n);
+    }
+
+    test_grammar(model, pieces, R"""(root ::= [a-z ]+ ".")""", 40, 1);
+    test_grammar(model, pieces, R"""(
+root ::= "{" ws "\"n\"" ws ":" ws [0-9]+ ws "}" ws
+ws   ::= [ \t\n]*)""", 40, 2);
+
+    // the other grammars contain non-ASCII code points, which are reached through single-byte tokens
+    int n_partial = 0;
+    n_partial += test_grammar(model, pieces, R"""(root ::= ("héllo" | "日本語" | [α-ω]+) " " [0-9]{1,3})""", 40, 3);
+    n_partial += test_grammar(model, pieces, R"""(root ::= [^\x00-\x7F]+ "!")""", 60, 4);
+    n_partial += test_grammar(model, pieces, R"""(root ::= ([^a-z] | "z")* "a")""", 60, 5);
+
+    // the states in the middle of a UTF-8 sequence do not use the cached masks
+    assert(n_partial > 0);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return 0;
+}
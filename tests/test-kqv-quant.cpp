@@ -0,0 +1,123 @@
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// checks KQV with a quantized V cache, computed with ggml_out_prod over the rows of V, against KQV with the
+// transposed F16 V cache, computed with ggml_mul_mat - the F16 V holds the dequantized values of the quantized V,
+// so both results only differ by the rounding of F16
+
+static float frand(void) {
+    return (float)rand()/(float)RAND_MAX;
+}
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads, nullptr);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+// normalized mean squared error
+static double nmse(const float * a, const float * b, int64_t n) {
+    double mse_a_b = 0.0;
+    double mse_a_0 = 0.0;
+
+    for (int64_t i = 0; i < n; i++) {
+        mse_a_b += (a[i] - b[i])*(a[i] - b[i]);
+        mse_a_0 += a[i]*a[i];
+    }
+
+    return mse_a_b/mse_a_0;
+}
+
+static bool test_kqv(ggml_type type, int64_t n_embd_head, int64_t n_kv, int64_t n_tokens, int64_t n_head, int64_t n_head_kv, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::vector<uint8_t> work_buffer;
+
+    // V in rows, as in the cache: [n_embd_head, n_kv, n_head_kv]
+    std::vector<float> v_data(n_embd_head*n_kv*n_head_kv);
+    for (auto & x : v_data) {
+        x = 2.0f*frand() - 1.0f;
+    }
+
+    struct ggml_tensor * v_q = ggml_new_tensor_3d(ctx, type, n_embd_head, n_kv, n_head_kv);
+    ggml_quantize_chunk(type, v_data.data(), v_q->data, 0, n_kv*n_head_kv, n_embd_head, nullptr);
+
+    std::vector<float> v_deq(v_data.size());
+    ggml_get_type_traits(type)->to_float(v_q->data, v_deq.data(), v_deq.size());
+
+    // transposed V, as in the F16 cache: [n_kv, n_embd_head, n_head_kv]
+    struct ggml_tensor * v_t = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_kv, n_embd_head, n_head_kv);
+    for (int64_t h = 0; h < n_head_kv; h++) {
+        for (int64_t i = 0; i < n_kv; i++) {
+            for (int64_t j = 0; j < n_embd_head; j++) {
+                ((ggml_fp16_t *) v_t->data)[(h*n_embd_head + j)*n_kv + i] = ggml_fp32_to_fp16(v_deq[(h*n_kv + i)*n_embd_head + j]);
+            }
+        }
+    }
+
+    // KQ after the soft max: [n_kv, n_tokens, n_head]
+    struct ggml_tensor * kq = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, n_tokens, n_head);
+    for (int64_t i = 0; i < ggml_nelements(kq); i++) {
+        ((float *) kq->data)[i] = frand();
+    }
+
+    struct ggml_tensor * kqv_q = ggml_out_prod(ctx, v_q, ggml_transpose(ctx, kq));
+    struct ggml_tensor * kqv_t = ggml_mul_mat (ctx, v_t, kq);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_build_forward_expand(gf, kqv_q);
+    ggml_build_forward_expand(gf, kqv_t);
+
+    ggml_graph_compute_helper(work_buffer, gf, n_threads);
+
+    GGML_ASSERT(ggml_are_same_shape(kqv_q, kqv_t));
+
+    const double err = nmse((const float *) kqv_t->data, (const float *) kqv_q->data, ggml_nelements(kqv_t));
+    const bool   ok  = err < 1e-5;
+
+    printf("%s: type = %-5s, n_embd_head = %3d, n_kv = %3d, n_tokens = %2d, n_head = %d, n_head_kv = %d, n_threads = %d: nmse = %e %s\n",
+            __func__, ggml_type_name(type), (int) n_embd_head, (int) n_kv, (int) n_tokens, (int) n_head, (int) n_head_kv, n_threads,
+            err, ok ? "OK" : "FAIL");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    const ggml_type types[] = {
+        GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0,
+    };
+
+    bool ok = true;
+
+    for (ggml_type type : types) {
+        // single sequence generation and prompt processing, with and without GQA
+        ok = test_kqv(type,  64, 40,  1, 8, 8, 1) && ok;
+        ok = test_kqv(type,  64, 40,  1, 8, 2, 3) && ok;
+        ok = test_kqv(type, 128, 67,  7, 8, 2, 4) && ok;
+        ok = test_kqv(type, 128, 67, 13, 6, 1, 5) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
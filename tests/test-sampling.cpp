@@ -1,5 +1,7 @@
 #include "ggml.h"
 #include "llama.h"
+#include "common.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +9,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -167,6 +171,60 @@ static void test_penalties(
     tester.check();
 }
 
+// accept more tokens than fit in the window and compare with the penalties recomputed from the last penalty_last_n tokens
+// the candidates are checked both in the order of their ids and reversed
+static void test_penalties_window(const int n_vocab, const int penalty_last_n, const int n_tokens) {
+    const float repeat_penalty  = 1.5f;
+    const float alpha_frequency = 0.25f;
+    const float alpha_presence  = 0.5f;
+
+    auto * sampler = llama_sampler_init_penalties(n_vocab, LLAMA_TOKEN_NULL, LLAMA_TOKEN_NULL, penalty_last_n, repeat_penalty, alpha_frequency, alpha_presence, false, false);
+
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        logits[i] = 8.0f*((float)(rand())/RAND_MAX - 0.5f);
+    }
+
+    std::vector<llama_token> tokens;
+
+    for (int t = 0; t < n_tokens; t++) {
+        // few distinct tokens, so that the counts go up and down as the window slides
+        const llama_token token = rand() % std::min(n_vocab, 16);
+
+        llama_sampler_accept(sampler, token);
+        tokens.push_back(token);
+
+        std::vector<int> count(n_vocab, 0);
+        for (int i = std::max(0, (int) tokens.size() - penalty_last_n); i < (int) tokens.size(); i++) {
+            count[tokens[i]]++;
+        }
+
+        for (int reversed = 0; reversed < 2; reversed++) {
+            std::vector<llama_token_data> cur;
+            for (int i = 0; i < n_vocab; i++) {
+                const llama_token id = reversed ? n_vocab - 1 - i : i;
+                cur.push_back({ id, logits[id], 0.0f });
+            }
+
+            llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+            llama_sampler_apply(sampler, &cur_p);
+
+            for (const auto & td : cur) {
+                float expected = logits[td.id];
+                if (count[td.id] > 0) {
+                    expected = expected <= 0 ? expected*repeat_penalty : expected/repeat_penalty;
+                    expected -= float(count[td.id]) * alpha_frequency + alpha_presence;
+                }
+                GGML_ASSERT(td.logit == expected);
+            }
+        }
+    }
+
+    llama_sampler_free(sampler);
+
+    printf("Penalties OK with n_vocab=%d penalty_last_n=%d n_tokens=%d\n", n_vocab, penalty_last_n, n_tokens);
+}
+
 static void test_sampler_queue(const size_t n_vocab, const std::string & samplers_sequence, const int top_k, const float top_p, const float min_p
 ) {
     sampler_tester tester(n_vocab);
@@ -243,6 +301,177 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static void test_token_mask(const int n_vocab) {
+    std::vector<uint32_t> mask(LLAMA_TOKEN_MASK_SIZE(n_vocab), 0);
+
+    // whole words of allowed and rejected tokens, as well as mixed ones
+    for (int i = 0; i < n_vocab; i++) {
+        if (i % 3 == 0 || (i / 32) % 4 == 1) {
+            mask[i / 32] |= 1u << (i % 32);
+        }
+    }
+    mask[2] = 0;
+
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        logits[i] = (float) i;
+    }
+
+    llama_token_mask_apply(logits.data(), mask.data(), n_vocab);
+
+    for (int i = 0; i < n_vocab; i++) {
+        const bool allowed = (mask[i / 32] >> (i % 32)) & 1;
+        GGML_ASSERT(allowed ? logits[i] == (float) i : logits[i] == -INFINITY);
+    }
+
+    printf("Token mask OK with n_vocab=%d\n", n_vocab);
+}
+
+static std::vector<llama_token> sample_candidates(
+        const std::vector<llama_token_data> & data, const std::vector<llama_logit_bias> & biases, int top_k, float min_p, size_t min_keep) {
+    std::vector<llama_token_data> cur = data;
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(1 << 20, biases.size(), biases.data()));
+    if (top_k > 0) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+    }
+    if (min_p > 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, min_keep));
+    }
+    llama_sampler_apply(chain, &cur_p);
+    llama_sampler_free(chain);
+
+    std::vector<llama_token> res;
+    for (size_t i = 0; i < cur_p.size; i++) {
+        res.push_back(cur_p.data[i].id);
+    }
+    std::sort(res.begin(), res.end());
+
+    return res;
+}
+
+static void test_logits_candidates(const int n_vocab, const int top_k, const float min_p, const size_t min_keep, const std::vector<llama_logit_bias> & biases) {
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        logits[i] = 8.0f*((float)(rand())/RAND_MAX - 0.5f);
+    }
+
+    std::vector<llama_token_data> data(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        data[i] = llama_token_data{i, logits[i], 0.0f};
+    }
+
+    std::vector<llama_token> keep;
+    for (const auto & lb : biases) {
+        keep.push_back(lb.token);
+    }
+
+    std::vector<llama_token_data> cand(n_vocab);
+    cand.resize(llama_logits_get_candidates(logits.data(), n_vocab, top_k, min_p, min_keep, keep.data(), keep.size(), cand.data()));
+
+    for (size_t i = 1; i < cand.size(); i++) {
+        GGML_ASSERT(cand[i - 1].id < cand[i].id);
+    }
+
+    GGML_ASSERT(sample_candidates(data, biases, top_k, min_p, min_keep) == sample_candidates(cand, biases, top_k, min_p, min_keep));
+
+    printf("Logits candidates OK with n_vocab=%d top_k=%d min_p=%f min_keep=%zu n_bias=%zu: %zu candidates\n",
+            n_vocab, top_k, min_p, min_keep, biases.size(), cand.size());
+}
+
+// common_sampler_sample_batch must return the tokens of common_sampler_sample for samplers with the same seeds
+static void test_sampler_batch(const char * model_path, const std::string & grammar, int n_threads) {
+    const int n_seq  = 4;
+    const int n_step = 8;
+
+    llama_model * model = llama_load_model_from_file(model_path, llama_model_default_params());
+    GGML_ASSERT(model != nullptr);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_seq_max = n_seq;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx != nullptr);
+
+    std::vector<common_sampler *> smpls_serial;
+    std::vector<common_sampler *> smpls_batch;
+
+    for (int s = 0; s < n_seq; ++s) {
+        common_sampler_params sparams;
+        sparams.seed    = 1234 + s;
+        sparams.temp    = 1.0f;
+        sparams.top_k   = 0;
+        sparams.grammar = grammar;
+
+        smpls_serial.push_back(common_sampler_init(model, sparams));
+        smpls_batch .push_back(common_sampler_init(model, sparams));
+    }
+
+    common_sampler_pool * pool = n_threads > 0 ? common_sampler_pool_init(n_threads) : nullptr;
+
+    llama_batch batch = llama_batch_init(512, 0, n_seq);
+
+    const std::vector<llama_token> prompt = common_tokenize(ctx, "Once upon a time", true);
+
+    std::vector<int> idxs(n_seq);
+
+    for (int s = 0; s < n_seq; ++s) {
+        for (size_t i = 0; i < prompt.size(); ++i) {
+            common_batch_add(batch, prompt[i], i, { s }, i == prompt.size() - 1);
+        }
+        idxs[s] = batch.n_tokens - 1;
+    }
+
+    int n_past = prompt.size();
+
+    for (int step = 0; step < n_step; ++step) {
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+        std::vector<llama_token> ids_serial(n_seq);
+        for (int s = 0; s < n_seq; ++s) {
+            ids_serial[s] = common_sampler_sample(smpls_serial[s], ctx, idxs[s]);
+        }
+
+        const std::vector<llama_token> ids_batch = common_sampler_sample_batch(pool, smpls_batch, ctx, idxs);
+
+        GGML_ASSERT(ids_batch.size() == (size_t) n_seq);
+
+        common_batch_clear(batch);
+
+        for (int s = 0; s < n_seq; ++s) {
+            if (ids_batch[s] != ids_serial[s]) {
+                fprintf(stderr, "%s: step %d, seq %d: batch sampled %d, serial sampled %d\n", __func__, step, s, ids_batch[s], ids_serial[s]);
+                GGML_ASSERT(false);
+            }
+
+            common_sampler_accept(smpls_serial[s], ids_serial[s], true);
+            common_sampler_accept(smpls_batch[s],  ids_batch[s],  true);
+
+            idxs[s] = batch.n_tokens;
+            common_batch_add(batch, ids_batch[s], n_past, { s }, true);
+        }
+
+        n_past++;
+    }
+
+    printf("%s: grammar = %s, n_threads = %d: OK\n", __func__, grammar.empty() ? "none" : "set", n_threads);
+
+    llama_batch_free(batch);
+
+    common_sampler_pool_free(pool);
+
+    for (int s = 0; s < n_seq; ++s) {
+        common_sampler_free(smpls_serial[s]);
+        common_sampler_free(smpls_batch[s]);
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -263,6 +492,26 @@ static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vec
 
 #define BENCH(__cnstr, __data, __n_iter) bench((__cnstr), #__cnstr, (__data), (__n_iter))
 
+static void bench_logits(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int top_k, float min_p, int n_iter) {
+    std::vector<float> logits(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        logits[i] = data[i].logit;
+    }
+    std::vector<llama_token_data> cur(data.size());
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_iter; i++) {
+        const size_t n = llama_logits_get_candidates(logits.data(), logits.size(), top_k, min_p, 1, nullptr, 0, cur.data());
+        llama_token_data_array cur_p = { cur.data(), n, -1, false };
+        llama_sampler_apply(cnstr, &cur_p);
+        llama_sampler_reset(cnstr);
+    }
+    const int64_t t_end = ggml_time_us();
+    llama_sampler_free(cnstr);
+    printf("%-43s: %8.3f us/iter (from logits)\n", cnstr_name, (t_end - t_start) / (float)n_iter);
+}
+
+#define BENCH_LOGITS(__cnstr, __data, __top_k, __min_p, __n_iter) bench_logits((__cnstr), #__cnstr, (__data), (__top_k), (__min_p), (__n_iter))
+
 static void test_perf() {
     const int n_vocab = 1 << 17;
 
@@ -280,9 +529,12 @@ static void test_perf() {
     BENCH(llama_sampler_init_tail_free(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_typical  (0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc      (1.0f, 0.1f, 1, 1),       data, 32);
+
+    BENCH_LOGITS(llama_sampler_init_top_k (40),                 data, 40,   0.0f, 32);
+    BENCH_LOGITS(llama_sampler_init_min_p (0.2f, 1),            data,  0,   0.2f, 32);
 }
 
-int main(void) {
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1.0f);
@@ -333,6 +585,10 @@ int main(void) {
     test_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_penalties_window(100,  8, 100);
+    test_penalties_window(100, 64, 100);
+    test_penalties_window(8,    4, 50);
+
     test_sampler_queue(10000, "k", 10000, 1.0f, 1.0f);
     test_sampler_queue(10000, "k",     1, 1.0f, 1.0f);
     test_sampler_queue(10000, "p", 10000, 1.0f, 1.0f);
@@ -361,6 +617,35 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_logits_candidates(1000,  40, 0.0f,  0, {});
+    test_logits_candidates(32000, 40, 0.0f,  0, {});
+    test_logits_candidates(32000,  1, 0.0f,  0, {});
+    test_logits_candidates(32000,  0, 0.05f, 0, {});
+    test_logits_candidates(32000,  0, 0.9f, 10, {});
+    test_logits_candidates(32000, 40, 0.05f, 0, {});
+    test_logits_candidates(32000, 40, 0.0f,  0, {{5, 100.0f}, {7, -INFINITY}, {9, -1.0f}});
+    test_logits_candidates(32000,  0, 0.05f, 0, {{5, 100.0f}, {7, -INFINITY}});
+    test_logits_candidates(100,   40, 0.0f,  0, {});
+
+    test_token_mask(32);
+    test_token_mask(1000);
+    test_token_mask(32000);
+
+    // the batched sampling needs the logits of a model
+    const char * model_path = argc > 1 ? argv[1] : getenv("LLAMACPP_TEST_MODELFILE");
+    if (model_path && strlen(model_path) > 0) {
+        llama_backend_init();
+
+        for (int n_threads : { 0, 1, 4 }) {
+            test_sampler_batch(model_path, "", n_threads);
+            test_sampler_batch(model_path, "root ::= [a-z ]+", n_threads);
+        }
+
+        llama_backend_free();
+    } else {
+        printf("test_sampler_batch: no model file provided, skipping (set LLAMACPP_TEST_MODELFILE to run it)\n");
+    }
+
     printf("OK\n");
 
     test_perf();
@@ -252,6 +252,36 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // batched tokenization
+    if (!k_tests.empty()) {
+        std::vector<std::string> texts;
+        std::string text_long;
+        for (const auto & test_kv : k_tests) {
+            texts.push_back(test_kv.first);
+        }
+        // long enough to be split into chunks
+        while (text_long.size() < 256*1024) {
+            for (const auto & test_kv : k_tests) {
+                text_long += test_kv.first + " word ";
+            }
+        }
+        texts.push_back(text_long);
+
+        const auto res = common_tokenize_batch(llama_get_model(ctx), texts, add_special, false, 4);
+
+        size_t i = 0;
+        for (const auto & test_kv : k_tests) {
+            if (res[i++] != test_kv.second) {
+                fprintf(stderr, "%s : failed batched test: '%s'\n", __func__, test_kv.first.c_str());
+                success = false;
+            }
+        }
+        if (res[i] != common_tokenize(ctx, text_long, add_special, false)) {
+            fprintf(stderr, "%s : failed batched test of a long text\n", __func__);
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());